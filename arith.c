@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Arithmetic built-ins
+//
+// The arithmetic and comparison functions are variadic: each one folds its
+// arguments in a single loop over raw int64_t values as arg_next() hands
+// them over, evaluated and type checked, and only the result is boxed.
+// (+ a b c d) costs one call and one new cell instead of three of each,
+// and takes any number of arguments.  Results that do not fit in 64 bits
+// are errors.
+
+// True is the interpreter's one t symbol, so a comparison that holds does
+// not allocate.
+LISP_VALUE *lisp_bool(int x)
+{
+  return x ? interp->t_symbol : create_nil();
+}
+
+LISP_VALUE *fn_add(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *x;
+  int64_t acc = 0;
+  int got;
+  while (1 == (got = arg_next(args, &x))) {
+    if (__builtin_add_overflow(acc, x->intnum, &acc)) {
+      error("Integer overflow.");
+      return NULL;
+    }
+  }
+  return got < 0 ? NULL : create_intnum(acc);
+}
+
+LISP_VALUE *fn_mul(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *x;
+  int64_t acc = 1;
+  int got;
+  while (1 == (got = arg_next(args, &x))) {
+    if (__builtin_mul_overflow(acc, x->intnum, &acc)) {
+      error("Integer overflow.");
+      return NULL;
+    }
+  }
+  return got < 0 ? NULL : create_intnum(acc);
+}
+
+// (- x) is -x.
+LISP_VALUE *fn_sub(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *x;
+  int64_t acc;
+  int got;
+  if (1 != arg_next(args, &x)) {
+    return NULL;
+  }
+  acc = x->intnum;
+  if (1 == args->n_args) {
+    if (__builtin_sub_overflow(0, acc, &acc)) {
+      error("Integer overflow.");
+      return NULL;
+    }
+    return create_intnum(acc);
+  }
+  while (1 == (got = arg_next(args, &x))) {
+    if (__builtin_sub_overflow(acc, x->intnum, &acc)) {
+      error("Integer overflow.");
+      return NULL;
+    }
+  }
+  return got < 0 ? NULL : create_intnum(acc);
+}
+
+// Truncating division.  (/ x) is 1/x.
+LISP_VALUE *fn_div(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *x;
+  int64_t acc = 1;
+  int64_t d;
+  int got;
+  if (args->n_args > 1) {
+    if (1 != arg_next(args, &x)) {
+      return NULL;
+    }
+    acc = x->intnum;
+  }
+  while (1 == (got = arg_next(args, &x))) {
+    d = x->intnum;
+    if (0 == d) {
+      error("Division by zero.");
+      return NULL;
+    }
+    if (-1 == d && INT64_MIN == acc) {
+      error("Integer overflow in division.");
+      return NULL;
+    }
+    acc /= d;
+  }
+  return got < 0 ? NULL : create_intnum(acc);
+}
+
+// Result has the sign of y, as in (mod -7 2) => 1.
+LISP_VALUE *fn_mod(LISP_VALUE *x, LISP_VALUE *y, LISP_VALUE *env)
+{
+  int64_t r;
+  if (0 == y->intnum) {
+    error("Division by zero.");
+    return NULL;
+  }
+  if (-1 == y->intnum) {
+    return create_intnum(0);
+  }
+  r = x->intnum % y->intnum;
+  if (0 != r && (r < 0) != (y->intnum < 0)) {
+    r += y->intnum;
+  }
+  return create_intnum(r);
+}
+
+LISP_VALUE *fn_min(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *ret;
+  LISP_VALUE *x;
+  int got;
+  if (1 != arg_next(args, &ret)) {
+    return NULL;
+  }
+  while (1 == (got = arg_next(args, &x))) {
+    if (x->intnum < ret->intnum) {
+      ret = x;
+    }
+  }
+  return got < 0 ? NULL : ret;
+}
+
+LISP_VALUE *fn_max(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  LISP_VALUE *ret;
+  LISP_VALUE *x;
+  int got;
+  if (1 != arg_next(args, &ret)) {
+    return NULL;
+  }
+  while (1 == (got = arg_next(args, &x))) {
+    if (x->intnum > ret->intnum) {
+      ret = x;
+    }
+  }
+  return got < 0 ? NULL : ret;
+}
+
+// The comparisons hold when they hold for each adjacent pair: (< a b c) is
+// a < b and b < c.  Every argument is evaluated even once one pair fails.
+enum {
+  COMPARE_LT,
+  COMPARE_LE,
+  COMPARE_EQ,
+  COMPARE_GT,
+  COMPARE_GE
+};
+
+LISP_VALUE *compare_chain(VARIADIC_ARGS *args, int op)
+{
+  LISP_VALUE *prev;
+  LISP_VALUE *x;
+  int holds = 1;
+  int got;
+  if (1 != arg_next(args, &prev)) {
+    return NULL;
+  }
+  while (1 == (got = arg_next(args, &x))) {
+    switch (op) {
+      case COMPARE_LT:
+        holds = holds && prev->intnum < x->intnum;
+        break;
+      case COMPARE_LE:
+        holds = holds && prev->intnum <= x->intnum;
+        break;
+      case COMPARE_EQ:
+        holds = holds && prev->intnum == x->intnum;
+        break;
+      case COMPARE_GT:
+        holds = holds && prev->intnum > x->intnum;
+        break;
+      case COMPARE_GE:
+        holds = holds && prev->intnum >= x->intnum;
+        break;
+    }
+    prev = x;
+  }
+  return got < 0 ? NULL : lisp_bool(holds);
+}
+
+LISP_VALUE *fn_num_lt(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  return compare_chain(args, COMPARE_LT);
+}
+
+LISP_VALUE *fn_num_le(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  return compare_chain(args, COMPARE_LE);
+}
+
+LISP_VALUE *fn_num_eq(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  return compare_chain(args, COMPARE_EQ);
+}
+
+LISP_VALUE *fn_num_gt(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  return compare_chain(args, COMPARE_GT);
+}
+
+LISP_VALUE *fn_num_ge(VARIADIC_ARGS *args, LISP_VALUE *env)
+{
+  return compare_chain(args, COMPARE_GE);
+}
+
+void install_arith_builtins(void)
+{
+  int idx;
+  idx = install_variadic_fn("+", "add", fn_add, 0);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("*", "mul", fn_mul, 0);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("-", "sub", fn_sub, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("/", "div", fn_div, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("mod", "mod", fn_mod, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("min", "min", fn_min, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("max", "max", fn_max, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("<", "<", fn_num_lt, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("<=", "<=", fn_num_le, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn("=", "=", fn_num_eq, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn(">", ">", fn_num_gt, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_variadic_fn(">=", ">=", fn_num_ge, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+}
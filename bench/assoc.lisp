@@ -0,0 +1,13 @@
+(setq assoc (fn (k alist)
+  (if alist
+      (if (= k (car (car alist))) (car alist) (assoc k (cdr alist)))
+      ())))
+(setq pairs (fn (n acc)
+  (if (= n 0) acc (pairs (- n 1) (cons (cons n (* n n)) acc)))))
+(setq table (pairs 200 ()))
+(setq lookups (fn (k acc)
+  (if (= k 0)
+      acc
+      (lookups (- k 1) (+ acc (cdr (assoc (+ 1 (mod k 200)) table)))))))
+(lookups 4000 0)
+(lookups 4000 0)
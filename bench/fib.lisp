@@ -0,0 +1,2 @@
+(setq fib (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(fib 24)
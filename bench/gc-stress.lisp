@@ -0,0 +1,8 @@
+(setq iota (fn (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+(setq live (iota 4000 ()))
+(setq pass (fn (k acc)
+  (if (= k 0)
+      acc
+      (pass (- k 1)
+            (fold + acc (map car (map (fn (x) (cons (* x k) live)) live)))))))
+(pass 100 0)
@@ -0,0 +1,4 @@
+(setq iota (fn (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+(setq churn (fn (acc k)
+  (+ acc (length (append (reverse (iota 1000 ())) (iota 1000 ()))))))
+(fold churn 0 (iota 200 ()))
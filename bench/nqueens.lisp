@@ -0,0 +1,18 @@
+(setq safe (fn (row dist placed)
+  (if placed
+      (if (= (car placed) row)
+          ()
+          (if (= (car placed) (+ row dist))
+              ()
+              (if (= (car placed) (- row dist))
+                  ()
+                  (safe row (+ dist 1) (cdr placed)))))
+      1)))
+(setq try (fn (row n placed)
+  (if (> row n)
+      0
+      (+ (if (safe row 1 placed) (queens n (cons row placed)) 0)
+         (try (+ row 1) n placed)))))
+(setq queens (fn (n placed)
+  (if (= (length placed) n) 1 (try 1 n placed))))
+(queens 8 ())
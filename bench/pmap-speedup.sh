@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compares (pmap f xs) on one thread against N threads.
+#
+#   bench/pmap-speedup.sh [ml-binary] [n-items] [max-threads]
+#
+# f is an arithmetic kernel of 2^DEPTH additions, so each element allocates
+# enough to make every worker collect its own heap several times.
+ML=${1:-./ml}
+N=${2:-2000}
+MAX_THREADS=${3:-$(getconf _NPROCESSORS_ONLN)}
+DEPTH=9
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v n="$N" -v depth="$DEPTH" '
+function kernel(d) {
+  if (d == 0) {
+    return "x"
+  }
+  return "(+ " kernel(d - 1) " " kernel(d - 1) ")"
+}
+BEGIN {
+  printf "(setq f (fn (x) %s))\n", kernel(depth)
+  printf "(setq xs (quote ("
+  for (i = 1; i <= n; i++) {
+    printf "%d ", i
+  }
+  printf ")))\n"
+  printf "(preduce + 0 (pmap f xs))\n"
+}' > "$TMP/pmap.lisp"
+
+now_ms() {
+  echo $(( $(date +%s%N) / 1000000 ))
+}
+
+base=
+threads=1
+while [ "$threads" -le "$MAX_THREADS" ]; do
+  start=$(now_ms)
+  ML_PMAP_THREADS=$threads "$ML" --no-cache "$TMP/pmap.lisp" |
+    tail -n 1 > "$TMP/out.$threads"
+  elapsed=$(( $(now_ms) - start ))
+  [ -z "$base" ] && base=$elapsed
+  if ! cmp -s "$TMP/out.1" "$TMP/out.$threads"; then
+    echo "threads=$threads: result differs from single-threaded run" >&2
+    exit 1
+  fi
+  awk -v t="$threads" -v ms="$elapsed" -v base="$base" 'BEGIN {
+    printf "threads=%-3d %8d ms  speedup %.2fx\n", t, ms, (ms > 0 ? base / ms : 0)
+  }'
+  threads=$(( threads * 2 ))
+done
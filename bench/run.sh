@@ -0,0 +1,88 @@
+#!/bin/sh
+# Runs the standard workloads and prints one line of JSON per workload:
+# wall time percentiles over the runs, and the cells allocated, freed and
+# collections from ML_GC_LOG=summary (the same on every run).
+#
+#   bench/run.sh [ml-binary] [runs]
+#
+#   fib        doubly recursive (fib 24): closure calls and arithmetic
+#   tak        (tak 18 12 6) three times: deep non-tail calls
+#   nqueens    counts the solutions to 8 queens
+#   lists      builds lists a cons at a time, reverses and appends them
+#   assoc      8000 lookups in a 200 entry association list
+#   gc-stress  maps over a live list of 4000, making short lived garbage
+#   reader     reads 60000 generated forms from stdin
+#   printer    prints a 1000 element list 200 times
+#
+# Build the binary with "make ml-opt"; "make bench" does both.  Times are
+# wall clock and include starting the interpreter.
+ML=${1:-./ml}
+RUNS=${2:-10}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v n=60000 'BEGIN {
+  for (i = 1; i <= n; i++) {
+    printf "(length (quote (alpha-%d %d \"string %d\" (nested (list %d) -%d) beta)))\n",
+           i % 97, i, i, i * 7, i
+  }
+}' > "$TMP/reader.lisp"
+
+awk -v n=200 'BEGIN {
+  print "(setq iota (fn (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))"
+  print "(setq xs (map (fn (x) (cons x (quote (sym \"str\" (1 2))))) (iota 1000 ())))"
+  for (i = 1; i <= n; i++) {
+    print "xs"
+  }
+}' > "$TMP/printer.lisp"
+
+now_ns() {
+  date +%s%N
+}
+
+# run name input: one run, reader input on stdin, others as a file.
+run() {
+  if [ reader = "$1" ]; then
+    ML_GC_LOG=summary "$ML" --no-cache < "$2"
+  else
+    ML_GC_LOG=summary "$ML" --no-cache "$2"
+  fi > /dev/null 2> "$TMP/err"
+}
+
+for input in "$DIR"/*.lisp "$TMP/reader.lisp" "$TMP/printer.lisp"; do
+  name=$(basename "$input" .lisp)
+  : > "$TMP/times"
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(now_ns)
+    if ! run "$name" "$input"; then
+      echo "$name: $ML failed:" >&2
+      cat "$TMP/err" >&2
+      exit 1
+    fi
+    echo $(( $(now_ns) - start )) >> "$TMP/times"
+    i=$(( i + 1 ))
+  done
+  if grep -q '^ERROR' "$TMP/err"; then
+    echo "$name: $ML reported errors:" >&2
+    cat "$TMP/err" >&2
+    exit 1
+  fi
+  sort -n "$TMP/times" | awk -v name="$name" -v err="$TMP/err" '
+    { t[n++] = $1 / 1e6 }
+    END {
+      while ((getline line < err) > 0) {
+        if (line ~ /^GC: /) {
+          split(line, f, /[ ,]+/)
+          collections = f[2]; paused = f[4]; allocated = f[7]; freed = f[10]
+        }
+      }
+      printf "{\"bench\":\"%s\",\"runs\":%d,", name, n
+      printf "\"median_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,",
+             t[int(n / 2)], t[int(n * 9 / 10)], t[int(n * 99 / 100)]
+      printf "\"min_ms\":%.3f,\"max_ms\":%.3f,", t[0], t[n - 1]
+      printf "\"cells_allocated\":%d,\"cells_freed\":%d,", allocated, freed
+      printf "\"collections\":%d,\"gc_pause_ms\":%.3f}\n", collections, paused
+    }'
+done
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Compares a cold "ml" run per request against requests sent to a warm
+# "ml --serve" instance.
+#
+#   bench/serve-latency.sh [ml-binary] [n-requests] [n-clients]
+#
+# Latency is the mean wall time of N sequential requests.  Throughput runs
+# N requests from n-clients concurrent client loops.
+ML=${1:-./ml}
+N=${2:-200}
+CLIENTS=${3:-4}
+TMP=$(mktemp -d)
+SOCK="$TMP/ml.sock"
+
+cat > "$TMP/prelude.lisp" <<'EOF'
+(setq twice (fn (f) (fn (x) (f (f x)))))
+(setq inc (fn (x) (+ x 1)))
+EOF
+echo '((twice (twice inc)) 38)' > "$TMP/request.lisp"
+
+"$ML" --no-cache "$TMP/prelude.lisp" --serve "$SOCK" --workers "$CLIENTS" \
+  > /dev/null 2>&1 &
+server=$!
+trap 'kill $server 2> /dev/null; wait $server; rm -rf "$TMP"' EXIT
+while [ ! -S "$SOCK" ]; do
+  sleep 0.1
+done
+
+now_ms() {
+  echo $(( $(date +%s%N) / 1000000 ))
+}
+
+cold() {
+  cat "$TMP/prelude.lisp" "$TMP/request.lisp" | "$ML" --no-cache > /dev/null
+}
+
+warm() {
+  "$ML" --client "$SOCK" "$TMP/request.lisp" > /dev/null
+}
+
+# run <label> <fn> <n>
+run() {
+  start=$(now_ms)
+  i=0
+  while [ "$i" -lt "$3" ]; do
+    $2
+    i=$(( i + 1 ))
+  done
+  elapsed=$(( $(now_ms) - start ))
+  awk -v label="$1" -v ms="$elapsed" -v n="$3" 'BEGIN {
+    printf "%-12s %8.3f ms/request\n", label, ms / n
+  }'
+}
+
+if ! warm || [ "$("$ML" --client "$SOCK" "$TMP/request.lisp" | tail -n 1)" \
+                 != "result =>42" ]; then
+  echo "server did not answer the test request" >&2
+  exit 1
+fi
+
+run cold cold "$N"
+run warm warm "$N"
+
+start=$(now_ms)
+pids=
+c=0
+while [ "$c" -lt "$CLIENTS" ]; do
+  run "client$c" warm $(( N / CLIENTS )) > /dev/null &
+  pids="$pids $!"
+  c=$(( c + 1 ))
+done
+wait $pids
+elapsed=$(( $(now_ms) - start ))
+awk -v ms="$elapsed" -v n=$(( N / CLIENTS * CLIENTS )) -v c="$CLIENTS" 'BEGIN {
+  printf "throughput   %8.0f requests/s with %d clients\n", (ms > 0 ? n * 1000 / ms : 0), c
+}'
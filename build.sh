@@ -1,4 +1,4 @@
 #!/bin/sh
 etags *.c *.h
-awk -f gather-protos.awk micro-lisp.c > proto.h
-clang -o ml -DDEBUG micro-lisp.c
+awk -f gather-protos.awk *.c > proto.h
+clang -o ml -DDEBUG *.c -lpthread
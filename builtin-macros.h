@@ -38,6 +38,9 @@ BUILTIN_FN_SIG(14);
 BUILTIN_FN_SIG(15);
 BUILTIN_FN_SIG(16);
 
+// A variadic builtin takes its arguments one at a time with arg_next().
+typedef LISP_VALUE *(*builtin_fn_v)(VARIADIC_ARGS *args, LISP_VALUE *env);
+
 #define UNPACKAGE_ARGS_0
 #define UNPACKAGE_ARGS_1  args[0],
 #define UNPACKAGE_ARGS_2  UNPACKAGE_ARGS_1  args[1],
@@ -57,4 +60,4 @@ BUILTIN_FN_SIG(16);
 #define UNPACKAGE_ARGS_16 UNPACKAGE_ARGS_15 args[15],
 
 #define CALL_BUILTIN_WITH_ARG_ARRAY(n)                      \
-  return (*pinfo->builtin_##n)(UNPACKAGE_ARGS_##n env);
+  ret = (*pinfo->builtin_##n)(UNPACKAGE_ARGS_##n env);
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Form cache
+//
+// Parsed source files are stored in cache_dir as <hash>.mlc, where <hash> is
+// the FNV-1a hash of the file contents.  A cache file holds a header followed
+// by the list of forms in the file, written depth first:
+//
+//     'c' <car> <cdr>       cons cell (cdr chains are written iteratively)
+//     'i' <int>             integer, native byte order
+//     's' <len> <chars>     symbol
+//     'S' <len> <bytes>     string, with a native int64_t length
+//     'n'                   nil
+//
+// Loading a cached file rebuilds the forms directly with new_value() and never
+// goes through the reader.  Cache files are only meant to be read by the
+// binary that wrote them; the header carries a format version so stale files
+// are simply ignored.
+
+#define CACHE_MAGIC "MLC"
+#define CACHE_VERSION 2
+
+enum {
+  CACHE_TAG_CONS   = 'c',
+  CACHE_TAG_INT    = 'i',
+  CACHE_TAG_SYMBOL = 's',
+  CACHE_TAG_STRING = 'S',
+  CACHE_TAG_NIL    = 'n'
+};
+
+// Directory holding cache files.  NULL until cache_init() picks a default.
+char *cache_dir = NULL;
+
+// Zero disables both reading and writing the cache (--no-cache).
+int cache_enabled = 1;
+
+uint64_t cache_hash(char *buf, long len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ CACHE_VERSION;
+  while (len-- > 0) {
+    h ^= (unsigned char) *buf++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Like "mkdir -p".
+int make_dirs(char *path)
+{
+  char tmp[1024];
+  char *p;
+  snprintf(tmp, sizeof(tmp), "%s", path);
+  for (p = tmp + 1; *p; ++p) {
+    if ('/' == *p) {
+      *p = '\0';
+      mkdir(tmp, 0755);
+      *p = '/';
+    }
+  }
+  return mkdir(tmp, 0755) < 0 ? access(tmp, W_OK) : 0;
+}
+
+void cache_init(void)
+{
+  static char default_dir[1024];
+  char *env;
+  if (NULL == cache_dir) {
+    if (NULL != (env = getenv("ML_CACHE_DIR"))) {
+      cache_dir = env;
+    } else if (NULL != (env = getenv("HOME"))) {
+      snprintf(default_dir, sizeof(default_dir), "%s/.cache/micro-lisp", env);
+      cache_dir = default_dir;
+    } else {
+      cache_enabled = 0;
+      return;
+    }
+  }
+  if (cache_enabled && make_dirs(cache_dir) < 0) {
+    fprintf(stderr, "WARNING: cannot use cache directory %s\n", cache_dir);
+    cache_enabled = 0;
+  }
+}
+
+void cache_path(char *dest, int size, uint64_t hash)
+{
+  snprintf(dest, size, "%s/%016llx.mlc", cache_dir, (unsigned long long) hash);
+}
+
+void cache_clear(void)
+{
+  DIR *dir;
+  struct dirent *ent;
+  char path[1024];
+  int len;
+  if (NULL == cache_dir || NULL == (dir = opendir(cache_dir))) {
+    return;
+  }
+  while (NULL != (ent = readdir(dir))) {
+    len = strlen(ent->d_name);
+    // Also removes the temporary files of writers that did not finish.
+    if ((len > 4 && STREQ(ent->d_name + len - 4, ".mlc")) ||
+        (len > 11 && 0 == strncmp(ent->d_name + len - 11, ".mlc.", 5))) {
+      snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+int cache_write_value(FILE *f, LISP_VALUE *v)
+{
+  int len;
+  while (IS_TYPE(v, V_CONS_CELL)) {
+    putc(CACHE_TAG_CONS, f);
+    if (cache_write_value(f, v->car) < 0) {
+      return -1;
+    }
+    v = v->cdr;
+  }
+  if (IS_TYPE(v, V_INT)) {
+    putc(CACHE_TAG_INT, f);
+    fwrite(&v->intnum, sizeof(v->intnum), 1, f);
+  } else if (IS_TYPE(v, V_SYMBOL)) {
+    len = strlen(v->symbol);
+    putc(CACHE_TAG_SYMBOL, f);
+    putc(len, f);
+    fwrite(v->symbol, 1, len, f);
+  } else if (IS_TYPE(v, V_STRING)) {
+    putc(CACHE_TAG_STRING, f);
+    fwrite(&v->str_length, sizeof(v->str_length), 1, f);
+    fwrite(string_data(v), 1, v->str_length, f);
+  } else if (IS_TYPE(v, V_NIL)) {
+    putc(CACHE_TAG_NIL, f);
+  } else {
+    // Only reader output (atoms and lists) can be cached.
+    return -1;
+  }
+  return 0;
+}
+
+LISP_VALUE *cache_read_atom(FILE *f, int tag)
+{
+  char name[SYM_SIZE];
+  int len;
+  int64_t n;
+  STRBUF *buf;
+  LISP_VALUE *ret;
+  switch (tag) {
+    case CACHE_TAG_INT:
+      ret = new_value(V_INT);
+      if (1 != fread(&ret->intnum, sizeof(ret->intnum), 1, f)) {
+        return NULL;
+      }
+      return ret;
+    case CACHE_TAG_SYMBOL:
+      len = getc(f);
+      if (len < 0 || len >= SYM_SIZE || (int) fread(name, 1, len, f) != len) {
+        return NULL;
+      }
+      name[len] = '\0';
+      return create_symbol(name);
+    case CACHE_TAG_STRING:
+      if (1 != fread(&n, sizeof(n), 1, f) || NULL == (buf = strbuf_alloc(n))) {
+        return NULL;
+      }
+      if ((int64_t) fread(buf->data, 1, n, f) != n) {
+        free(buf);
+        return NULL;
+      }
+      buf->used = n;
+      return create_string(buf, 0, n);
+    case CACHE_TAG_NIL:
+      return create_nil();
+  }
+  return NULL;
+}
+
+LISP_VALUE *cache_read_value(FILE *f)
+{
+  LISP_VALUE *head;
+  LISP_VALUE *tail;
+  LISP_VALUE *v;
+  int tag = getc(f);
+  if (CACHE_TAG_CONS != tag) {
+    return cache_read_atom(f, tag);
+  }
+  head = new_value(V_CONS_CELL);
+  tail = head;
+  for (;;) {
+    if (NULL == (v = cache_read_value(f))) {
+      head = NULL;
+      break;
+    }
+    tail->car = v;
+    tag = getc(f);
+    if (CACHE_TAG_CONS != tag) {
+      if (NULL == (tail->cdr = cache_read_atom(f, tag))) {
+        head = NULL;
+      }
+      break;
+    }
+    tail->cdr = new_value(V_CONS_CELL);
+    tail = tail->cdr;
+  }
+  return head;
+}
+
+// Returns the cached list of forms for a file with the given content hash, or
+// NULL on a cache miss.
+LISP_VALUE *cache_fetch(uint64_t hash)
+{
+  char path[1024];
+  char magic[4];
+  FILE *f;
+  LISP_VALUE *forms = NULL;
+  if (!cache_enabled) {
+    return NULL;
+  }
+  cache_path(path, sizeof(path), hash);
+  if (NULL == (f = fopen(path, "rb"))) {
+    return NULL;
+  }
+  if (4 == fread(magic, 1, 4, f) &&
+      0 == memcmp(magic, CACHE_MAGIC, 3) && CACHE_VERSION == magic[3]) {
+    forms = code_copy(cache_read_value(f));
+  }
+  fclose(f);
+  DBG_FN_PRINT_VAR(path, "%s");
+  return forms;
+}
+
+void cache_store(uint64_t hash, LISP_VALUE *forms)
+{
+  char path[1024];
+  char tmp_path[1100];
+  FILE *f;
+  int fd;
+  int ok;
+  if (!cache_enabled) {
+    return;
+  }
+  cache_path(path, sizeof(path), hash);
+  // Write to a private name and rename() so concurrent loaders never see a
+  // partially written file.  mkstemp() picks a name no other process or
+  // -j thread is using; it creates the file readable by its owner only.
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp_path)) < 0) {
+    return;
+  }
+  fchmod(fd, 0644);
+  if (NULL == (f = fdopen(fd, "wb"))) {
+    close(fd);
+    unlink(tmp_path);
+    return;
+  }
+  fwrite(CACHE_MAGIC, 1, 3, f);
+  putc(CACHE_VERSION, f);
+  ok = 0 == cache_write_value(f, forms);
+  ok = 0 == fclose(f) && ok;
+  if (!ok || rename(tmp_path, path) < 0) {
+    unlink(tmp_path);
+  }
+}
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <setjmp.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Heap census
+//
+// heap_census() counts the allocated cells of each type, then marks from
+// global_env alone, from the other roots sweep() uses (the C stacks) without
+// looking into closures, and finally from what the closures marked so far
+// capture, to tell what keeps them alive.  It leaves mark bits behind, which the next gc()
+// clears.  (heap-census) returns the counts, and running out of memory
+// prints them before giving up.
+//
+// With $ML_ALLOC_SAMPLE=N, every Nth cell handed out by cell_take() is
+// charged to the innermost form being evaluated, which eval_application()
+// and eval_syntax() keep in interp->alloc_form.  (alloc-sites) lists the
+// forms by estimated cells allocated, and the top ones are printed at exit
+// (including the exit on running out of memory).
+
+uint64_t alloc_sample_every = 0;
+
+// Adds the cells of each type in the heap to counts: all allocated cells, or
+// only the marked ones.
+void heap_count(int64_t *counts, int marked_only)
+{
+  PAGE *page;
+  uint64_t bits;
+  int i;
+  int w;
+  for (i = 0; i < interp->n_pages_used; ++i) {
+    page = (PAGE *) (interp->heap + i*PAGE_SIZE);
+    if (V_UNALLOCATED == page->value_type) {
+      continue;
+    }
+    for (w = 0; w < PAGE_BITMAP_WORDS; ++w) {
+      bits = page->allocated[w];
+      if (marked_only) {
+        bits &= page->marked[w];
+      }
+      counts[type_slot(page->value_type)] += __builtin_popcountll(bits);
+    }
+  }
+}
+
+// Marks what the marked closures capture.
+void census_walk_closures(void)
+{
+  PAGE *page;
+  LISP_VALUE *v;
+  int i;
+  int j;
+  for (i = 0; i < interp->n_pages_used; ++i) {
+    page = (PAGE *) (interp->heap + i*PAGE_SIZE);
+    if (V_CLOSURE != page->value_type) {
+      continue;
+    }
+    for (j = 0; j < page->n_cells; ++j) {
+      if (BIT_TEST(page->allocated, j) && BIT_TEST(page->marked, j)) {
+        v = page_cell(page, j);
+        gc_walk(v->arg_names, 0);
+        gc_walk(v->env, 0);
+        gc_walk(v->code, 0);
+      }
+    }
+  }
+}
+
+void heap_census(HEAP_CENSUS *c)
+{
+  int64_t from_roots[N_TYPE_SLOTS] = {0};
+  int64_t reachable[N_TYPE_SLOTS] = {0};
+  jmp_buf regs;
+  int i;
+  memset(c, 0, sizeof(HEAP_CENSUS));
+  heap_count(c->allocated, 0);
+  mark();
+  gc_walk(interp->global_env, 0);
+  gc_walk(interp->t_symbol, 0);
+  heap_count(c->from_global, 1);
+  interp->skip_closure_children = 1;
+  setjmp(regs);
+  gc_scan_range(stack_pointer(), interp->current_task->stack_top);
+  sched_gc_walk();
+  prof_gc_walk();
+  alloc_sites_gc_walk();
+  interp->skip_closure_children = 0;
+  heap_count(from_roots, 1);
+  census_walk_closures();
+  heap_count(reachable, 1);
+  for (i = 0; i < N_TYPE_SLOTS; ++i) {
+    c->from_stacks[i] = from_roots[i] - c->from_global[i];
+    c->from_closures[i] = reachable[i] - from_roots[i];
+  }
+}
+
+void heap_census_print(FILE *out)
+{
+  HEAP_CENSUS c;
+  int64_t garbage;
+  int i;
+  heap_census(&c);
+  fprintf(out, "Heap: %d of %d pages used\n", interp->n_pages_used, HEAP_PAGES);
+  fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s\n", "type", "cells",
+          "KB", "global", "stacks", "closures", "garbage");
+  for (i = 0; i < N_TYPE_SLOTS; ++i) {
+    if (0 == c.allocated[i]) {
+      continue;
+    }
+    garbage = c.allocated[i] - c.from_global[i] - c.from_closures[i] -
+      c.from_stacks[i];
+    fprintf(out, "%-10s %10lld %10lld %10lld %10lld %10lld %10lld\n",
+            type_name(1 << i), (long long) c.allocated[i],
+            (long long) (c.allocated[i] << cell_shift(1 << i))/1024,
+            (long long) c.from_global[i], (long long) c.from_stacks[i],
+            (long long) c.from_closures[i], (long long) garbage);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Allocation sampling
+
+// Called from cell_take() for every sampled cell.
+void alloc_sample(int slot)
+{
+  LISP_VALUE *form = NULL == interp->alloc_form ? TOPLEVEL_FORM
+                                                : interp->alloc_form;
+  ALLOC_SITE *site;
+  uint64_t i = ((uintptr_t) form >> 4)*0x9e3779b97f4a7c15ull >> 40;
+  int n;
+  interp->next_sample += alloc_sample_every;
+  // Samples from new sites are dropped once the table is full.
+  for (n = 0; n < ALLOC_SITES; ++n, ++i) {
+    site = &interp->alloc_sites[(i + slot) & (ALLOC_SITES - 1)];
+    if (NULL == site->form) {
+      site->form = form;
+      site->type = 1 << slot;
+    }
+    if (form == site->form && (1 << slot) == site->type) {
+      site->samples += 1;
+      return;
+    }
+  }
+}
+
+void alloc_sites_gc_walk(void)
+{
+  int i;
+  if (NULL != interp->alloc_sites) {
+    for (i = 0; i < ALLOC_SITES; ++i) {
+      if (TOPLEVEL_FORM != interp->alloc_sites[i].form) {
+        gc_walk(interp->alloc_sites[i].form, 0);
+      }
+    }
+  }
+}
+
+int alloc_site_cmp(const void *x, const void *y)
+{
+  uint64_t a = ((const ALLOC_SITE *) x)->samples;
+  uint64_t b = ((const ALLOC_SITE *) y)->samples;
+  return a > b ? -1 : a < b;
+}
+
+// Copies the used sites into a malloc()ed array, most samples first.
+ALLOC_SITE *alloc_sites_sorted(int *n_sites)
+{
+  ALLOC_SITE *sites = malloc(ALLOC_SITES*sizeof(ALLOC_SITE));
+  int i;
+  *n_sites = 0;
+  if (NULL == sites) {
+    return NULL;
+  }
+  for (i = 0; i < ALLOC_SITES; ++i) {
+    if (NULL != interp->alloc_sites[i].form) {
+      sites[(*n_sites)++] = interp->alloc_sites[i];
+    }
+  }
+  qsort(sites, *n_sites, sizeof(ALLOC_SITE), alloc_site_cmp);
+  return sites;
+}
+
+void alloc_sites_print(FILE *out, int max_sites)
+{
+  FILE *saved_output = interp->output;
+  ALLOC_SITE *sites;
+  int n;
+  int i;
+  if (NULL == interp->alloc_sites ||
+      NULL == (sites = alloc_sites_sorted(&n))) {
+    return;
+  }
+  fprintf(out, "Allocation sites (1 in %llu cells sampled):\n",
+          (unsigned long long) alloc_sample_every);
+  interp->output = out;
+  for (i = 0; i < n && i < max_sites; ++i) {
+    fprintf(out, "%12llu %-8s ",
+            (unsigned long long) (sites[i].samples*alloc_sample_every),
+            type_name(sites[i].type));
+    if (TOPLEVEL_FORM == sites[i].form) {
+      fprintf(out, "(toplevel)\n");
+    } else {
+      print_lisp_value(sites[i].form, 1);
+    }
+  }
+  interp->output = saved_output;
+  free(sites);
+}
+
+// atexit() handler for the main interpreter.
+void alloc_sites_at_exit(void)
+{
+  if (NULL != interp) {
+    alloc_sites_print(stderr, 20);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Heap census built-ins
+
+// (heap-census): ((type cells global stacks closures garbage) ...)
+LISP_VALUE *fn_heap_census(LISP_VALUE *env)
+{
+  HEAP_CENSUS c;
+  LISP_VALUE *ret = create_nil();
+  LISP_VALUE *row;
+  int i;
+  heap_census(&c);
+  for (i = N_TYPE_SLOTS - 1; i >= 0; --i) {
+    if (0 == c.allocated[i]) {
+      continue;
+    }
+    row = cons(create_intnum(c.allocated[i] - c.from_global[i] -
+                             c.from_closures[i] - c.from_stacks[i]),
+               create_nil());
+    row = cons(create_intnum(c.from_closures[i]), row);
+    row = cons(create_intnum(c.from_stacks[i]), row);
+    row = cons(create_intnum(c.from_global[i]), row);
+    row = cons(create_intnum(c.allocated[i]), row);
+    row = cons(create_symbol(type_name(1 << i)), row);
+    ret = cons(row, ret);
+  }
+  return ret;
+}
+
+// (alloc-sites): ((cells type form) ...), most cells first.  Cells are
+// estimated from the samples; nil unless $ML_ALLOC_SAMPLE is set.
+LISP_VALUE *fn_alloc_sites(LISP_VALUE *env)
+{
+  ALLOC_SITE *sites;
+  LISP_VALUE *ret = create_nil();
+  LISP_VALUE *row;
+  int n;
+  if (NULL == interp->alloc_sites ||
+      NULL == (sites = alloc_sites_sorted(&n))) {
+    return ret;
+  }
+  // The forms stay reachable through interp->alloc_sites while the list is
+  // built.
+  while (n-- > 0) {
+    row = cons(TOPLEVEL_FORM == sites[n].form ? create_symbol("toplevel")
+                                              : sites[n].form,
+               create_nil());
+    row = cons(create_symbol(type_name(sites[n].type)), row);
+    row = cons(create_intnum(sites[n].samples*alloc_sample_every), row);
+    ret = cons(row, ret);
+  }
+  free(sites);
+  return ret;
+}
+
+void install_census_builtins(void)
+{
+  char *every = getenv("ML_ALLOC_SAMPLE");
+  if (NULL != every) {
+    alloc_sample_every = strtoull(every, NULL, 10);
+  }
+  install_builtin_fn("heap-census", "heap-census", fn_heap_census, 0);
+  install_builtin_fn("alloc-sites", "alloc-sites", fn_alloc_sites, 0);
+}
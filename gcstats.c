@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Collector telemetry
+//
+// gc() times its three phases and collect() counts the cells it keeps and
+// frees; gc_stats_record() turns that into interp->gc_stats.  (gc-stats)
+// returns the numbers as a property list.  With $ML_GC_LOG set, every
+// collection logs a line to stderr and the main interpreter prints a summary
+// with pause percentiles at exit; ML_GC_LOG=summary prints only the summary.
+
+// 0: quiet, 1: summary at exit, 2: also a line per collection.  Set from
+// $ML_GC_LOG before any interpreter exists.
+int gc_log = 0;
+
+void gc_stats_record(uint64_t start, uint64_t marked, uint64_t swept,
+                     uint64_t end)
+{
+  GC_STATS *s = &interp->gc_stats;
+  uint64_t mutator_time = start - s->last_end;
+  uint64_t *grown;
+  int64_t capacity;
+  s->mark_time = marked - start;
+  s->sweep_time = swept - marked;
+  s->collect_time = end - swept;
+  s->alloc_rate = 0 == mutator_time ? 0
+    : (double) (s->n_allocated - s->allocated_at_last)*1e9/mutator_time;
+  s->allocated_at_last = s->n_allocated;
+  s->total_pause += end - start;
+  s->total_freed += s->n_freed;
+  if (s->n_collections == s->pauses_capacity) {
+    capacity = 0 == s->pauses_capacity ? 64 : 2*s->pauses_capacity;
+    if (NULL != (grown = realloc(s->pauses, capacity*sizeof(uint64_t)))) {
+      s->pauses = grown;
+      s->pauses_capacity = capacity;
+    }
+  }
+  // Pauses that did not fit are left out of the percentiles.
+  if (s->n_collections < s->pauses_capacity) {
+    s->pauses[s->n_collections] = end - start;
+  }
+  s->n_collections += 1;
+  if (gc_log > 1) {
+    flush_output();
+    fprintf(stderr, "gc %llu: pause %.3f ms (mark %.3f, sweep %.3f, "
+            "collect %.3f), live %lld, freed %lld, survival %.1f%%, "
+            "alloc %.3f Mcells/s, %d pages\n",
+            (unsigned long long) s->n_collections, (end - start)/1e6,
+            s->mark_time/1e6, s->sweep_time/1e6, s->collect_time/1e6,
+            (long long) s->n_live, (long long) s->n_freed,
+            100*gc_survival(s),
+            s->alloc_rate/1e6, interp->n_pages_used);
+  }
+  s->last_end = now_ns();
+}
+
+// Fraction of the cells allocated at the last collection that survived it.
+double gc_survival(GC_STATS *s)
+{
+  int64_t n = s->n_live + s->n_freed;
+  return 0 == n ? 0 : (double) s->n_live/n;
+}
+
+int gc_pause_cmp(const void *x, const void *y)
+{
+  uint64_t a = *(const uint64_t *) x;
+  uint64_t b = *(const uint64_t *) y;
+  return a < b ? -1 : a > b;
+}
+
+void gc_stats_summary(GC_STATS *s, FILE *out)
+{
+  int64_t n = s->n_collections < s->pauses_capacity ? s->n_collections
+                                                    : s->pauses_capacity;
+  uint64_t *sorted;
+  int64_t i;
+  int64_t count;
+  uint64_t bound;
+  fprintf(out, "GC: %llu collections, %.3f ms paused, %llu cells allocated, "
+          "%llu freed\n", (unsigned long long) s->n_collections,
+          s->total_pause/1e6, (unsigned long long) s->n_allocated,
+          (unsigned long long) s->total_freed);
+  if (0 == n || NULL == (sorted = malloc(n*sizeof(uint64_t)))) {
+    return;
+  }
+  memcpy(sorted, s->pauses, n*sizeof(uint64_t));
+  qsort(sorted, n, sizeof(uint64_t), gc_pause_cmp);
+  fprintf(out, "GC pause ms: p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+          sorted[n/2]/1e6, sorted[n*9/10]/1e6, sorted[n*99/100]/1e6,
+          sorted[n - 1]/1e6);
+  // Histogram in power of 2 microsecond buckets.
+  for (i = 0, bound = 1000; i < n; bound *= 2) {
+    for (count = 0; i < n && sorted[i] < bound; ++i) {
+      count += 1;
+    }
+    if (count > 0) {
+      fprintf(out, "  < %8llu us: %lld\n", (unsigned long long) bound/1000,
+              (long long) count);
+    }
+  }
+  free(sorted);
+}
+
+// atexit() handler for the main interpreter.
+void gc_stats_at_exit(void)
+{
+  if (NULL != interp) {
+    gc_stats_summary(&interp->gc_stats, stderr);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Collector telemetry built-ins
+
+// (gc-stats): (collections n allocated n ...).  Times are in microseconds;
+// pause-us through survival-pct describe the last collection.
+LISP_VALUE *fn_gc_stats(LISP_VALUE *env)
+{
+  GC_STATS *s = &interp->gc_stats;
+  char *names[] = {
+    "collections", "allocated", "pages", "pause-us", "mark-us", "sweep-us",
+    "collect-us", "live", "freed", "survival-pct", "alloc-per-sec",
+    "total-pause-us", "total-freed"
+  };
+  int64_t values[] = {
+    s->n_collections, s->n_allocated, interp->n_pages_used,
+    (s->mark_time + s->sweep_time + s->collect_time)/1000,
+    s->mark_time/1000, s->sweep_time/1000, s->collect_time/1000,
+    s->n_live, s->n_freed, 100*gc_survival(s), s->alloc_rate,
+    s->total_pause/1000, s->total_freed
+  };
+  int n = sizeof(values)/sizeof(values[0]);
+  LISP_VALUE *ret = create_nil();
+  // Built back to front; each cons may collect, which the conservative scan
+  // of this frame survives.
+  while (n-- > 0) {
+    ret = cons(create_intnum(values[n]), ret);
+    ret = cons(create_symbol(names[n]), ret);
+  }
+  return ret;
+}
+
+void install_gc_stats_builtins(void)
+{
+  char *log = getenv("ML_GC_LOG");
+  if (NULL != log && '\0' != log[0]) {
+    gc_log = STREQ(log, "summary") ? 1 : 2;
+  }
+  install_builtin_fn("gc-stats", "gc-stats", fn_gc_stats, 0);
+}
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// List built-ins
+//
+// The list functions work out how long their result is first, then take all
+// of its cells at once from new_cons_list() and fill them in.  A result list
+// is laid out in address order, and building one costs a single free list
+// run and at most one collection instead of a new_value() per cell.
+
+// Number of elements of list, or -1 (after reporting it) if list does not
+// end in nil.
+int64_t list_length(char *fn_name, LISP_VALUE *list)
+{
+  LISP_VALUE *p;
+  int64_t n = 0;
+  FOR_LIST(p, list) {
+    n += 1;
+  }
+  if (!IS_TYPE(p, V_NIL)) {
+    flush_output();
+    fprintf(stderr, "ERROR: %s: improper list.\n", fn_name);
+    return -1;
+  }
+  return n;
+}
+
+LISP_VALUE *fn_cons(LISP_VALUE *x, LISP_VALUE *y, LISP_VALUE *env)
+{
+  return cons(x, y);
+}
+
+LISP_VALUE *fn_car(LISP_VALUE *x, LISP_VALUE *env)
+{
+  return car(x);
+}
+
+LISP_VALUE *fn_cdr(LISP_VALUE *x, LISP_VALUE *env)
+{
+  return cdr(x);
+}
+
+LISP_VALUE *fn_length(LISP_VALUE *list, LISP_VALUE *env)
+{
+  int64_t n = list_length("length", list);
+  return n < 0 ? NULL : create_intnum(n);
+}
+
+LISP_VALUE *fn_append(LISP_VALUE *a, LISP_VALUE *b, LISP_VALUE *env)
+{
+  int64_t n = list_length("append", a);
+  LISP_VALUE *ret;
+  LISP_VALUE *p;
+  LISP_VALUE *q;
+  if (n < 0 || NULL == (ret = new_cons_list(n, b))) {
+    return NULL;
+  }
+  for (p = a, q = ret; IS_TYPE(p, V_CONS_CELL); p = cdr(p), q = cdr(q)) {
+    q->car = car(p);
+  }
+  return ret;
+}
+
+LISP_VALUE *fn_reverse(LISP_VALUE *list, LISP_VALUE *env)
+{
+  int64_t n = list_length("reverse", list);
+  LISP_VALUE **cells;
+  LISP_VALUE *ret;
+  LISP_VALUE *p;
+  LISP_VALUE *q;
+  if (n < 0 || NULL == (ret = new_cons_list(n, create_nil()))) {
+    return NULL;
+  }
+  if (NULL == (cells = malloc((n + 1)*sizeof(LISP_VALUE *)))) {
+    error("reverse: out of memory.");
+    return NULL;
+  }
+  // Element i of list goes into cell n-1-i of the result.
+  for (q = ret; IS_TYPE(q, V_CONS_CELL); q = cdr(q)) {
+    cells[--n] = q;
+  }
+  FOR_LIST(p, list) {
+    cells[n++]->car = car(p);
+  }
+  free(cells);
+  return ret;
+}
+
+// (apply fn list) calls fn with the elements of list as its arguments.
+LISP_VALUE *fn_apply(LISP_VALUE *fn, LISP_VALUE *list, LISP_VALUE *env)
+{
+  if (list_length("apply", list) < 0) {
+    return NULL;
+  }
+  return apply_fn(fn, list);
+}
+
+LISP_VALUE *fn_map(LISP_VALUE *fn, LISP_VALUE *list, LISP_VALUE *env)
+{
+  int64_t n = list_length("map", list);
+  LISP_VALUE *ret;
+  LISP_VALUE *p;
+  LISP_VALUE *q;
+  if (n < 0 || NULL == (ret = new_cons_list(n, create_nil()))) {
+    return NULL;
+  }
+  for (p = list, q = ret; IS_TYPE(p, V_CONS_CELL); p = cdr(p), q = cdr(q)) {
+    if (NULL == (q->car = apply_fn_1(fn, car(p)))) {
+      return NULL;
+    }
+  }
+  return ret;
+}
+
+LISP_VALUE *fn_filter(LISP_VALUE *fn, LISP_VALUE *list, LISP_VALUE *env)
+{
+  int64_t n = list_length("filter", list);
+  int64_t n_kept = 0;
+  int64_t i;
+  char *keep;
+  LISP_VALUE *ret = NULL;
+  LISP_VALUE *p;
+  LISP_VALUE *q;
+  LISP_VALUE *v;
+  if (n < 0) {
+    return NULL;
+  }
+  if (NULL == (keep = malloc(n + 1))) {
+    error("filter: out of memory.");
+    return NULL;
+  }
+  i = 0;
+  FOR_LIST(p, list) {
+    if (NULL == (v = apply_fn_1(fn, car(p)))) {
+      free(keep);
+      return NULL;
+    }
+    keep[i] = !IS_TYPE(v, V_NIL);
+    n_kept += keep[i++];
+  }
+  if (NULL != (ret = new_cons_list(n_kept, create_nil()))) {
+    for (p = list, q = ret, i = 0; IS_TYPE(p, V_CONS_CELL); p = cdr(p)) {
+      if (keep[i++]) {
+        q->car = car(p);
+        q = cdr(q);
+      }
+    }
+  }
+  free(keep);
+  return ret;
+}
+
+// (fold fn init list): (fn (fn init x1) x2) ...
+LISP_VALUE *fn_fold(LISP_VALUE *fn, LISP_VALUE *acc, LISP_VALUE *list,
+                    LISP_VALUE *env)
+{
+  LISP_VALUE *p;
+  FOR_LIST(p, list) {
+    if (NULL == (acc = apply_fn(fn, cons(acc, cons(car(p), create_nil()))))) {
+      return NULL;
+    }
+  }
+  return acc;
+}
+
+void install_list_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("cons", "cons", fn_cons, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_ANY);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  idx = install_builtin_fn("car", "car", fn_car, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL);
+  idx = install_builtin_fn("cdr", "cdr", fn_cdr, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL);
+  idx = install_builtin_fn("length", "length", fn_length, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("append", "append", fn_append, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL | V_NIL);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  idx = install_builtin_fn("reverse", "reverse", fn_reverse, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("apply", "apply", fn_apply, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("map", "map", fn_map, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("filter", "filter", fn_filter, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("fold", "fold", fn_fold, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_CONS_CELL | V_NIL);
+}
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Memoized functions
+//
+// (memoize f) returns a callable that looks its argument list up in a
+// cache before calling f.  Argument lists are compared structurally:
+// integers by value, symbols by name, lists element by element and
+// anything else by identity.  memo_hash() only looks MEMO_HASH_DEPTH lists
+// deep and at the first MEMO_HASH_ITEMS elements of each, so hashing a big
+// argument costs a bounded amount; equal hashes are still compared in full.
+//
+// The cache keeps up to limit results (MEMO_DEFAULT_LIMIT, or as given to
+// memoize-with) and then evicts the least recently used or the oldest
+// entry.  Keys and values are heap values reachable through the memo cell,
+// so gc_walk() marks them and they die with it or when evicted.
+//
+// A memo made by one interpreter and called from another (a pmap worker)
+// just calls f: the cache only ever holds values of its own heap.
+
+uint64_t memo_atom_hash(LISP_VALUE *v)
+{
+  uint64_t h;
+  if (IS_TYPE(v, V_INT | V_SYMBOL)) {
+    return table_hash(v);
+  }
+  if (IS_TYPE(v, V_NIL)) {
+    return 0x2545f4914f6cdd1dull;
+  }
+  h = ((uintptr_t) v >> 3)*0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
+}
+
+uint64_t memo_hash(LISP_VALUE *v, int depth)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  int n = 0;
+  if (!IS_TYPE(v, V_CONS_CELL)) {
+    return memo_atom_hash(v);
+  }
+  for (; IS_TYPE(v, V_CONS_CELL) && n < MEMO_HASH_ITEMS; v = cdr(v), ++n) {
+    h = (h ^ (depth < MEMO_HASH_DEPTH ? memo_hash(car(v), depth + 1)
+                                      : IS_TYPE(car(v), V_CONS_CELL)))
+      *0x100000001b3ull;
+  }
+  if (!IS_TYPE(v, V_CONS_CELL)) {
+    h = (h ^ memo_atom_hash(v))*0x100000001b3ull;
+  }
+  return h ^ (h >> 32);
+}
+
+int memo_equal(LISP_VALUE *x, LISP_VALUE *y)
+{
+  for (;;) {
+    if (x == y) {
+      return 1;
+    }
+    if (NULL == x || NULL == y || TYPE_OF(x) != TYPE_OF(y)) {
+      return 0;
+    }
+    switch (TYPE_OF(x)) {
+      case V_INT:
+        return x->intnum == y->intnum;
+      case V_SYMBOL:
+        return sym_eq(x, y);
+      case V_NIL:
+        return 1;
+      case V_CONS_CELL:
+        if (!memo_equal(car(x), car(y))) {
+          return 0;
+        }
+        x = cdr(x);
+        y = cdr(y);
+        break;
+      default:
+        return 0;
+    }
+  }
+}
+
+// Entry cached for key, or -1.
+int32_t memo_find(MEMO *m, LISP_VALUE *key, uint64_t hash)
+{
+  int64_t mask = m->index_size - 1;
+  int64_t i = hash & mask;
+  MEMO_ENTRY *e;
+  while (-1 != m->index[i]) {
+    e = &m->entries[m->index[i]];
+    if (hash == e->hash && memo_equal(e->key, key)) {
+      return m->index[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+void memo_index_add(MEMO *m, int32_t entry)
+{
+  int64_t mask = m->index_size - 1;
+  int64_t i = m->entries[entry].hash & mask;
+  while (-1 != m->index[i]) {
+    i = (i + 1) & mask;
+  }
+  m->index[i] = entry;
+}
+
+// Takes entry out of the index, moving back later slots of its probe
+// sequence as table_remove_slot() does.
+void memo_index_remove(MEMO *m, int32_t entry)
+{
+  int64_t mask = m->index_size - 1;
+  int64_t i = m->entries[entry].hash & mask;
+  int64_t j;
+  int64_t home;
+  while (entry != m->index[i]) {
+    i = (i + 1) & mask;
+  }
+  for (j = i;;) {
+    j = (j + 1) & mask;
+    if (-1 == m->index[j]) {
+      break;
+    }
+    home = m->entries[m->index[j]].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      m->index[i] = m->index[j];
+      i = j;
+    }
+  }
+  m->index[i] = -1;
+}
+
+// Rebuilds the index from entries[0..count).
+void memo_reindex(MEMO *m)
+{
+  int64_t i;
+  memset(m->index, -1, m->index_size*sizeof(int32_t));
+  for (i = 0; i < m->count; ++i) {
+    memo_index_add(m, i);
+  }
+}
+
+int memo_grow(MEMO *m)
+{
+  int64_t capacity = 2*m->capacity < m->limit ? 2*m->capacity : m->limit;
+  int64_t index_size = m->index_size;
+  MEMO_ENTRY *entries;
+  int32_t *index;
+  while (index_size < 2*capacity) {
+    index_size *= 2;
+  }
+  if (NULL == (entries = realloc(m->entries, capacity*sizeof(MEMO_ENTRY)))) {
+    return 0;
+  }
+  m->entries = entries;
+  m->capacity = capacity;
+  if (index_size != m->index_size) {
+    if (NULL == (index = malloc(index_size*sizeof(int32_t)))) {
+      return 0;
+    }
+    free(m->index);
+    m->index = index;
+    m->index_size = index_size;
+    memo_reindex(m);
+  }
+  return 1;
+}
+
+void memo_unlink(MEMO *m, int32_t entry)
+{
+  MEMO_ENTRY *e = &m->entries[entry];
+  if (-1 == e->prev) {
+    m->head = e->next;
+  } else {
+    m->entries[e->prev].next = e->next;
+  }
+  if (-1 == e->next) {
+    m->tail = e->prev;
+  } else {
+    m->entries[e->next].prev = e->prev;
+  }
+}
+
+void memo_push_front(MEMO *m, int32_t entry)
+{
+  MEMO_ENTRY *e = &m->entries[entry];
+  e->prev = -1;
+  e->next = m->head;
+  if (-1 == m->head) {
+    m->tail = entry;
+  } else {
+    m->entries[m->head].prev = entry;
+  }
+  m->head = entry;
+}
+
+// Caches value for key, evicting the last entry if the cache is full.
+// Returns 0 if out of memory.
+int memo_put(MEMO *m, LISP_VALUE *key, LISP_VALUE *value, uint64_t hash)
+{
+  int32_t entry = memo_find(m, key, hash);
+  MEMO_ENTRY *e;
+  if (-1 != entry) {
+    m->entries[entry].value = value;
+    return 1;
+  }
+  if (m->count == m->limit) {
+    entry = m->tail;
+    memo_index_remove(m, entry);
+    memo_unlink(m, entry);
+    m->evictions += 1;
+  } else {
+    if (m->count == m->capacity && !memo_grow(m)) {
+      return 0;
+    }
+    entry = m->count++;
+  }
+  e = &m->entries[entry];
+  e->key = key;
+  e->value = value;
+  e->hash = hash;
+  memo_index_add(m, entry);
+  memo_push_front(m, entry);
+  return 1;
+}
+
+LISP_VALUE *memo_apply(LISP_VALUE *memo, LISP_VALUE *args)
+{
+  MEMO *m = memo->memo;
+  uint64_t hash;
+  int32_t entry;
+  LISP_VALUE *ret;
+  if (!IN_HEAP(memo)) {
+    return apply_fn(m->fn, args);
+  }
+  hash = memo_hash(args, 0);
+  if (-1 != (entry = memo_find(m, args, hash))) {
+    m->hits += 1;
+    if (MEMO_LRU == m->policy && entry != m->head) {
+      memo_unlink(m, entry);
+      memo_push_front(m, entry);
+    }
+    return m->entries[entry].value;
+  }
+  m->misses += 1;
+  // f may call the memo recursively, so the cache can change meanwhile.
+  if (NULL != (ret = apply_fn(m->fn, args)) && !memo_put(m, args, ret, hash)) {
+    error("Cannot grow memo cache.");
+  }
+  return ret;
+}
+
+void memo_gc_walk(MEMO *m, int depth)
+{
+  int64_t i;
+  gc_walk(m->fn, depth);
+  for (i = 0; i < m->count; ++i) {
+    gc_walk(m->entries[i].key, depth);
+    gc_walk(m->entries[i].value, depth);
+  }
+}
+
+void memo_free(MEMO *m)
+{
+  free(m->entries);
+  free(m->index);
+  free(m);
+}
+
+//------------------------------------------------------------------------------
+/// Memoization built-ins
+
+LISP_VALUE *memo_create(LISP_VALUE *fn, int64_t limit, int policy)
+{
+  MEMO *m = calloc(1, sizeof(MEMO));
+  LISP_VALUE *ret;
+  if (NULL == m) {
+    error("Cannot allocate memo.");
+    return NULL;
+  }
+  m->fn = fn;
+  m->policy = policy;
+  m->limit = limit;
+  m->head = m->tail = -1;
+  m->index_size = TABLE_INITIAL_CAPACITY;
+  if (NULL == (m->index = malloc(m->index_size*sizeof(int32_t)))) {
+    free(m);
+    error("Cannot allocate memo.");
+    return NULL;
+  }
+  memset(m->index, -1, m->index_size*sizeof(int32_t));
+  m->capacity = m->index_size/2;
+  if (NULL == (m->entries = malloc(m->capacity*sizeof(MEMO_ENTRY)))) {
+    memo_free(m);
+    error("Cannot allocate memo.");
+    return NULL;
+  }
+  ret = new_value(V_MEMO);
+  ret->memo = m;
+  return ret;
+}
+
+LISP_VALUE *fn_memoize(LISP_VALUE *fn, LISP_VALUE *env)
+{
+  return memo_create(fn, MEMO_DEFAULT_LIMIT, MEMO_LRU);
+}
+
+// (memoize-with f limit policy): policy is lru or fifo.
+LISP_VALUE *fn_memoize_with(LISP_VALUE *fn, LISP_VALUE *limit,
+                            LISP_VALUE *policy, LISP_VALUE *env)
+{
+  if (limit->intnum < 1 || limit->intnum > INT32_MAX/2) {
+    error("memoize-with: limit out of range.");
+    return NULL;
+  }
+  if (KW_EQ(policy, "lru")) {
+    return memo_create(fn, limit->intnum, MEMO_LRU);
+  } else if (KW_EQ(policy, "fifo")) {
+    return memo_create(fn, limit->intnum, MEMO_FIFO);
+  }
+  error("memoize-with: policy should be lru or fifo.");
+  return NULL;
+}
+
+// (memo-stats m): (hits n misses n evictions n size n limit n)
+LISP_VALUE *fn_memo_stats(LISP_VALUE *memo, LISP_VALUE *env)
+{
+  MEMO *m = memo->memo;
+  char *names[] = {"hits", "misses", "evictions", "size", "limit"};
+  int64_t values[] = {m->hits, m->misses, m->evictions, m->count, m->limit};
+  int n = sizeof(values)/sizeof(values[0]);
+  LISP_VALUE *ret = create_nil();
+  while (n-- > 0) {
+    ret = cons(create_intnum(values[n]), ret);
+    ret = cons(create_symbol(names[n]), ret);
+  }
+  return ret;
+}
+
+void install_memo_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("memoize", "memoize", fn_memoize, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  idx = install_builtin_fn("memoize-with", "memoize-with", fn_memoize_with, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_SYMBOL);
+  idx = install_builtin_fn("memo-stats", "memo-stats", fn_memo_stats, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_MEMO);
+}
@@ -2,6 +2,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "util.h"
 #include "micro-lisp.h"
 #include "proto.h"
@@ -9,29 +16,8 @@
 //------------------------------------------------------------------------------
 /// Globals
 
-// Array of values.  This is the "source" for all LISP_VALUEs
-LISP_VALUE mem[MAX_VALUES];
-
-// Free list of cells from mem[].
-LISP_VALUE *free_list_head = NULL;
-
-// Counter for reporting.
-int n_free_values = N_SYNTAX_KEYWORDS;
-
-// Stack of cells in mem[] for which may not be collected during GC.
-// Ancestors to values on protect_stack[] are also saved from collection.
-LISP_VALUE *protect_stack[MAX_PROTECTED];
-int protect_stack_ptr = 0;
-
-// Current input character not yet processed.
-char current_char = '\n';
-
-// Nesting level of lists.
-int nest_level = 0;
-
-// Global environment.  Gets special treatment since everything points to
-// it.
-LISP_VALUE *global_env;
+// Interpreter running on this thread.  See struct INTERP.
+__thread INTERP *interp = NULL;
 
 // Index of next function to be placed into builtin_list[].
 int builtin_index = N_SYNTAX_KEYWORDS;
@@ -39,17 +25,38 @@ int builtin_index = N_SYNTAX_KEYWORDS;
 //------------------------------------------------------------------------------
 /// Utility
 
+// Writes out what the current interpreter has printed so far, so that a
+// message written to stderr next comes after it (--serve sends both to the
+// client).  Leaves errno alone for a perror() that follows.
+void flush_output(void)
+{
+  int saved_errno = errno;
+  if (NULL != interp && NULL != interp->output) {
+    fflush(interp->output);
+  }
+  errno = saved_errno;
+}
+
 void error(char *msg)
 {
+  flush_output();
   fprintf(stderr, "ERROR: %s\n", msg);
 }
 
 void fatal(char *msg)
 {
+  flush_output();
   fprintf(stderr, "FATAL: %s\n", msg);
   exit(1);
 }
 
+uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 int sym_eq(LISP_VALUE *x, LISP_VALUE *y)
 {
   return STREQ(x->symbol, y->symbol);
@@ -83,10 +90,26 @@ LISP_VALUE *caddr(LISP_VALUE *x)
   return x->cdr->cdr->car;
 }
 
+LISP_VALUE *list1(LISP_VALUE *x)
+{
+  LISP_VALUE *ret;
+  ret = cons(x, NULL);
+  ret->cdr = create_nil();
+  return ret;
+}
+
+LISP_VALUE *list2(LISP_VALUE *x, LISP_VALUE *y)
+{
+  LISP_VALUE *ret;
+  ret = list1(y);
+  ret = cons(x, ret);
+  return ret;
+}
+
 //------------------------------------------------------------------------------
 /// Value creation
 
-LISP_VALUE *create_intnum(int n)
+LISP_VALUE *create_intnum(int64_t n)
 {
   LISP_VALUE *ret = new_value(V_INT);
   ret->intnum = n;
@@ -134,48 +157,79 @@ void print_lisp_value_aux(LISP_VALUE *val, int nest_level,
                           int has_items_following)
 {
   if (NULL == val) {
-    printf("<NULL>");
+    fprintf(interp->output, "<NULL>");
+    return;
   }
-  switch (val->value_type)
+  switch (TYPE_OF(val))
   {
     case V_INT:
-      printf("%d", val->intnum);
+      fprintf(interp->output, "%lld", (long long) val->intnum);
       break;
     case V_SYMBOL:
-      printf("%s", val->symbol);
+      fprintf(interp->output, "%s", val->symbol);
       break;
     case V_CONS_CELL:
-      printf("(");
+      fprintf(interp->output, "(");
       while (IS_TYPE(val, V_CONS_CELL)) {
         print_lisp_value_aux(val->car, nest_level + 1,
                              !IS_TYPE(val->cdr, V_NIL));
         val = val->cdr;
       }
       if (!IS_TYPE(val, V_NIL)) {
-        printf(". ");
+        fprintf(interp->output, ". ");
         print_lisp_value_aux(val, nest_level + 1, 0);
       }
-      printf(")");
+      fprintf(interp->output, ")");
       break;
     case V_CLOSURE:
-      printf("#<CLOSURE: %p, %p, %p>", val->arg_names, val->code, val->env);
+      fprintf(interp->output, "#<CLOSURE: %p, %p, %p>", val->arg_names,
+              val->code, val->env);
       break;
     case V_NIL:
       if (nest_level > 0) {
-        printf("()");
+        fprintf(interp->output, "()");
       } else {
-        printf("nil");
+        fprintf(interp->output, "nil");
       }
       break;
     case V_BUILTIN:
-      printf("#<BUILTIN: %s>", val->func_info->name);
+      fprintf(interp->output, "#<BUILTIN: %s>", val->func_info->name);
+      break;
+    case V_CHANNEL:
+      fprintf(interp->output, "#<CHANNEL: %d/%d>", val->channel->count,
+              val->channel->capacity);
+      break;
+    case V_VECTOR:
+      print_vector(val->vector);
+      break;
+    case V_HASHTABLE:
+      fprintf(interp->output, "#<HASHTABLE: %lld>",
+              (long long) val->hashtable->count);
+      break;
+    case V_STRING:
+      print_string(val);
+      break;
+    case V_STREAM:
+      // Printing must not force the rest.
+      fprintf(interp->output, "#<STREAM: ");
+      print_lisp_value_aux(val->stream_head, nest_level + 1, 0);
+      fprintf(interp->output, IS_TYPE(val->stream_rest, V_CONS_CELL) ?
+              " ...>" : " .>");
+      break;
+    case V_PORT:
+      fprintf(interp->output, "#<PORT: %s>",
+              NULL == val->port->file ? "closed" : "open");
+      break;
+    case V_MEMO:
+      fprintf(interp->output, "#<MEMO: %lld/%lld>",
+              (long long) val->memo->count, (long long) val->memo->limit);
       break;
     default:
       fatal("Unknown lisp type.\n");
       break;
   }
   if (has_items_following) {
-    printf(" ");
+    fprintf(interp->output, " ");
   }
 }
 
@@ -183,28 +237,29 @@ void print_lisp_value(LISP_VALUE *val, int print_newline)
 {
   print_lisp_value_aux(val, 0, 0);
   if (print_newline) {
-    printf("\n");
+    fprintf(interp->output, "\n");
   }
 }
 
 void next_char(void)
 {
-  if ('\n' == current_char) {
-    while ('\n' == current_char) {
-      if (nest_level > 0) {
-        printf("%d", nest_level);
+  FILE *in = NULL == interp->input_stream ? stdin : interp->input_stream;
+  if ('\n' == interp->current_char && interp->show_prompt) {
+    while ('\n' == interp->current_char) {
+      if (interp->nest_level > 0) {
+        fprintf(interp->output, "%d", interp->nest_level);
       }
-      printf(">");
-      current_char = getchar();
+      fprintf(interp->output, ">");
+      interp->current_char = getc(in);
     }
   } else {
-    current_char = getchar();
+    interp->current_char = getc(in);
   }
 }
 
 void skip_blanks(void)
 {
-  while (IS_WHITESPACE(current_char)) {
+  while (IS_WHITESPACE(interp->current_char)) {
     next_char();
   }
 }
@@ -214,267 +269,605 @@ LISP_VALUE *read_atom(void)
   int n_char = 0;
   int maybe_number = 1;
   int sign = 1;
-  int intnum = 0;
+  int64_t intnum = 0;
   int saw_digit = 0;
-  LISP_VALUE *ret = new_value(V_ANY);
-  while (IS_ATOM_CHAR(current_char)) {
-    if (('+' == current_char) || '-' == current_char) {
+  char name[SYM_SIZE];
+  name[0] = '\0';
+  while (IS_ATOM_CHAR(interp->current_char)) {
+    if (('+' == interp->current_char) || '-' == interp->current_char) {
       // Sign (+|-) can only occur as first char.
       maybe_number = maybe_number && (0 == n_char);
       if (maybe_number) {
-        sign = '-' == current_char ? -1 : 1;
+        sign = '-' == interp->current_char ? -1 : 1;
       }
-    } else if (IS_DIGIT(current_char)) {
+    } else if (IS_DIGIT(interp->current_char)) {
       saw_digit = 1;
       if (maybe_number) {
         // We have a digit and what we've seen so far looks like a number.
-        intnum = intnum*10 + (current_char - '0');
+        intnum = intnum*10 + (interp->current_char - '0');
       }
     } else {
       maybe_number = 0;
     }
     if (n_char < SYM_SIZE - 1) {
-      ret->symbol[n_char++] = current_char;
-      ret->symbol[n_char] = '\0';
+      name[n_char++] = interp->current_char;
+      name[n_char] = '\0';
     }
     next_char();
   }
   if (maybe_number && saw_digit) {
-    ret->value_type = V_INT;
-    ret->intnum = sign*intnum;
-  } else {
-    ret->value_type = V_SYMBOL;
+    return create_intnum(sign*intnum);
   }
-  return ret;
+  return create_symbol(name);
 }
 
+// Returns NULL on a read error or at end of input (EOF == current_char).
 LISP_VALUE *read_lisp_value(void)
 {
   skip_blanks();
-  if (IS_ATOM_CHAR(current_char)) {
+  if (EOF == interp->current_char) {
+    return NULL;
+  } else if (IS_ATOM_CHAR(interp->current_char)) {
     return read_atom();
-  } else if ('(' == current_char) {
+  } else if ('"' == interp->current_char) {
+    next_char();
+    return read_string();
+  } else if ('(' == interp->current_char) {
     return read_list();
-  } else if (')' == current_char) {
+  } else if (')' == interp->current_char) {
     error("Unbalanced parens.");
   } else {
     error("Read error.");
   }
+  // Skip the offending character so the next read makes progress.
+  next_char();
   return NULL;
 }
 
 LISP_VALUE *read_list(void)
 {
-  LISP_VALUE *ret = new_value(V_CONS_CELL);
+  LISP_VALUE *head = new_value(V_CONS_CELL);
   LISP_VALUE *left;
-  LISP_VALUE *right;
   LISP_VALUE *curr;
-  protect_from_gc(ret);
-  nest_level += 1;
+  interp->nest_level += 1;
   next_char();  // skip '('
   skip_blanks();
-  curr = ret;
-  curr->value_type = V_CONS_CELL;
-  while (')' != current_char) {
+  curr = head;
+  while (')' != interp->current_char) {
+    if (EOF == interp->current_char) {
+      error("Unexpected end of input in list.");
+      interp->nest_level -= 1;
+      return NULL;
+    }
     left = read_lisp_value();
     skip_blanks();
-    curr->car = left;
-    right = new_value(V_CONS_CELL);
-    curr->cdr = right;
-    curr = right;
+    curr->cdr = cons(left, NULL);
+    curr = curr->cdr;
   }
   next_char();   // skip ')'
-  curr->value_type = V_NIL;
-  nest_level -= 1;
-  unprotect_from_gc();
-  return ret;
+  curr->cdr = create_nil();
+  interp->nest_level -= 1;
+  return head->cdr;
 }
 
 //------------------------------------------------------------------------------
 /// Memory/GC
+//
+// The heap is HEAP_PAGES pages of PAGE_SIZE bytes.  Every page holds cells of
+// a single type and size (see cell_shift()), so a cell carries no header of
+// its own: its type, mark bit and allocation bit are kept in the PAGE at the
+// start of its page.  A cons cell is two pointers and an integer one word.
+// Pages left without live cells after a collection go back to a free list
+// and may be reused for another type.
+
+void gc(void)
+{
+  uint64_t start;
+  uint64_t marked;
+  uint64_t swept;
+  int outer_phase;
+  DBG_MSG("Garbage collecting...");
+  TRACE_EVENT(TRACE_GC_START, interp->gc_stats.n_allocated, NULL);
+  outer_phase = perf_phase(PERF_GC_MARK);
+  start = now_ns();
+  mark();
+  marked = now_ns();
+  sweep();
+  swept = now_ns();
+  perf_phase(PERF_GC_COLLECT);
+  collect();
+  gc_stats_record(start, marked, swept, now_ns());
+  perf_phase(outer_phase);
+  TRACE_EVENT(TRACE_GC_END, interp->gc_stats.n_freed, NULL);
+  DBG_FN_PRINT_VAR(interp->n_free_values, "%d");
+}
 
-void dump_protect_stack(void)
+// log2 of the size of a cell of the given type.
+int cell_shift(int value_type)
 {
-#ifdef DEBUG
+  switch (value_type) {
+    case V_CONS_CELL:
+    case V_SYMBOL:
+    case V_STREAM:
+      return 4;
+    case V_CLOSURE:
+    case V_STRING:
+      return 5;
+  }
+  return 3;
+}
+
+// Index into INTERP.free_cells[] for a type.
+int type_slot(int value_type)
+{
+  return __builtin_ctz(value_type);
+}
+
+int cell_index(LISP_VALUE *v)
+{
+  PAGE *page = PAGE_OF(v);
+  return ((char *) v - PAGE_CELLS(page)) >> page->cell_shift;
+}
+
+LISP_VALUE *page_cell(PAGE *page, int i)
+{
+  return (LISP_VALUE *) (PAGE_CELLS(page) + (i << page->cell_shift));
+}
+
+int cell_allocated(LISP_VALUE *v)
+{
+  return BIT_TEST(PAGE_OF(v)->allocated, cell_index(v));
+}
+
+// Marks v free without putting it on a free list.  Only used on heaps that
+// are never allocated from again (see pmap_copy()).
+void cell_release(LISP_VALUE *v)
+{
+  BIT_CLEAR(PAGE_OF(v)->allocated, cell_index(v));
+}
+
+void page_format(PAGE *page, int value_type)
+{
+  memset(page, 0, sizeof(PAGE));
+  page->value_type = value_type;
+  page->cell_shift = cell_shift(value_type);
+  page->n_cells = (PAGE_SIZE - PAGE_HEADER_SIZE) >> page->cell_shift;
+}
+
+// Puts the cells of page not allocated onto the free list for its type,
+// lowest address first.
+void page_thread_free_cells(PAGE *page)
+{
+  int slot = type_slot(page->value_type);
+  LISP_VALUE **head = &interp->free_cells[slot];
+  LISP_VALUE *v;
   int i;
-  DBG_MSG("Protect stack:");
-  for (i = 0; i < protect_stack_ptr; ++i) {
-    printf("! %02d : slot #%ld, addr %p\n", i, protect_stack[i] - mem,
-           protect_stack[i]);
-    if (IS_ATOM(protect_stack[i])) {
-      DBG_MSG("value = ");
-      DBG_PRINT_LISP_VAR(protect_stack[i]);
+  for (i = page->n_cells - 1; i >= 0; --i) {
+    if (!BIT_TEST(page->allocated, i)) {
+      v = page_cell(page, i);
+      v->next_free = *head;
+      *head = v;
+      interp->n_free_cells[slot] += 1;
+      interp->n_free_values += 1;
     }
   }
-  DBG_MSG("Bottom of protect stack");
-#endif
 }
 
-void gc(void)
+// Takes a page from the free pages, or one never used before, and makes its
+// cells available for values of the given type.  Returns 0 if every page is
+// in use.
+int page_add(int value_type)
 {
-  DBG_MSG("Garbage collecting...");
-  mark();
-  dump_protect_stack();
-  sweep();
-  collect();
-  DBG_FN_PRINT_VAR(n_free_values, "%d");
+  PAGE *page = interp->free_pages;
+  if (NULL != page) {
+    interp->free_pages = page->next;
+  } else if (interp->n_pages_used < HEAP_PAGES) {
+    page = (PAGE *) (interp->heap + interp->n_pages_used*PAGE_SIZE);
+    interp->n_pages_used += 1;
+  } else {
+    return 0;
+  }
+  page_format(page, value_type);
+  page_thread_free_cells(page);
+  return 1;
 }
 
 void mark(void)
 {
+  PAGE *page;
   int i;
-  DBG_MSG("Marking gc_mark = 0 on all values...");
-  for (i = 0; i < MAX_VALUES; ++i) {
-    // Zero out marked bit.  Zero mark bit means "collect"
-    mem[i].gc_mark = 0;
+  DBG_MSG("Clearing mark bits on all pages...");
+  for (i = 0; i < interp->n_pages_used; ++i) {
+    page = (PAGE *) (interp->heap + i*PAGE_SIZE);
+    memset(page->marked, 0, sizeof(page->marked));
   }
-#ifdef DEBUG
-  printf("! Marked %d values/cons cells.\n", i);
-#endif
 }
 
+// Roots are global_env, t_symbol and whatever the running code can still
+// reach: the C stacks and saved registers of every task, which are scanned
+// conservatively (see gc_scan_range()).
 void sweep(void)
 {
-  int i;
+  jmp_buf regs;
   DBG_MSG("Walking global_env.");
-  gc_walk(global_env, 0);
-#ifdef DEBUG
-  printf("! Walking protect_stack[].  Size == %d.\n", protect_stack_ptr);
-#endif
-  for (i = 0; i < protect_stack_ptr; i++) {
-#ifdef DEBUG
-    printf("! Walking protect_stack[%d] ==%p.\n", i, protect_stack[i]);
-#endif
-    gc_walk(protect_stack[i], 0);
+  gc_walk(interp->global_env, 0);
+  gc_walk(interp->t_symbol, 0);
+  DBG_MSG("Scanning the stack.");
+  // Spill callee-saved registers into this frame so the scan sees values
+  // held only in registers.
+  setjmp(regs);
+  gc_scan_range(stack_pointer(), interp->current_task->stack_top);
+  DBG_MSG("Walking suspended tasks.");
+  sched_gc_walk();
+  prof_gc_walk();
+  alloc_sites_gc_walk();
+}
+
+// Returns an address below every frame of its caller.
+__attribute__((noinline)) char *stack_pointer(void)
+{
+  return __builtin_frame_address(0);
+}
+
+// Treats every aligned word in [lo, hi) as a possible pointer and marks the
+// cell it points into, if any.  Pointers into the middle of a cell count,
+// since the compiler is free to keep only &v->cdr around.  An integer that
+// happens to look like a heap address merely keeps a cell alive too long.
+void gc_scan_range(void *lo, void *hi)
+{
+  uintptr_t base = (uintptr_t) interp->heap;
+  uintptr_t limit = base + interp->n_pages_used*PAGE_SIZE;
+  uintptr_t *p;
+  uintptr_t w;
+  PAGE *page;
+  int i;
+  p = (uintptr_t *) (((uintptr_t) lo + sizeof(w) - 1) & ~(sizeof(w) - 1));
+  for (; (char *) (p + 1) <= (char *) hi; ++p) {
+    w = *p;
+    if (w < base || w >= limit) {
+      continue;
+    }
+    page = PAGE_OF(w);
+    if (V_UNALLOCATED == page->value_type ||
+        w < (uintptr_t) PAGE_CELLS(page)) {
+      continue;
+    }
+    i = (w - (uintptr_t) PAGE_CELLS(page)) >> page->cell_shift;
+    if (i < page->n_cells && BIT_TEST(page->allocated, i)) {
+      gc_walk(page_cell(page, i), 0);
+    }
   }
 }
 
-void indent(int n)
+// Marks v and, if it points to other values, pushes it on the mark stack.
+// Values outside this interpreter's heap belong to another interpreter (see
+// pmap) or to the code arena and are neither marked nor traversed.
+void gc_mark_push(LISP_VALUE *v)
 {
-  while (n-- > 0) {
-    printf("    ");
+  PAGE *page;
+  LISP_VALUE **stack;
+  int64_t size;
+  int i;
+  if (NULL == v || !IN_HEAP(v)) {
+    return;
+  }
+  page = PAGE_OF(v);
+  i = cell_index(v);
+  if (BIT_TEST(page->marked, i)) {
+    return;
+  }
+  if (!BIT_TEST(page->allocated, i)) {
+    fatal("gc_walk() on V_UNALLOCATED.\n");
+  }
+  BIT_SET(page->marked, i);
+  if (!(page->value_type & (V_CONS_CELL | V_CLOSURE | V_STREAM | V_CHANNEL |
+                            V_HASHTABLE | V_MEMO))) {
+    return;
   }
+  if (interp->n_mark_stack == interp->mark_stack_size) {
+    size = 0 == interp->mark_stack_size ? MARK_STACK_INITIAL
+                                        : 2*interp->mark_stack_size;
+    if (NULL == (stack = realloc(interp->mark_stack,
+                                 size*sizeof(LISP_VALUE *)))) {
+      fatal("Cannot grow the mark stack.");
+    }
+    interp->mark_stack = stack;
+    interp->mark_stack_size = size;
+  }
+  interp->mark_stack[interp->n_mark_stack++] = v;
 }
 
+// Marks v and everything reachable from it.  The values still to be
+// traversed are kept on interp->mark_stack rather than on the C stack, which
+// may be a task's TASK_STACK_SIZE stack, so long lists and deep structures
+// cost heap instead.  A gc_walk() made while traversing (channel_gc_walk()
+// and the like) only pushes; the outermost call empties the stack.
 void gc_walk(LISP_VALUE *v, int depth)
 {
-  if (NULL != v) {
-    indent(depth);
-#ifdef DEBUG
-    printf("! gc_walk(slot == %ld, ptr == %p) : ", v - mem, v);
-#endif
-    if (!v->gc_mark) {
-      DBG_MSG("not visited - to be saved.");
-      v->gc_mark = 1;
-      indent(depth);
-      switch (v->value_type) {
-        case V_INT:
-        case V_SYMBOL:
-        case V_NIL:
-          break;
-        case V_CONS_CELL:
-          indent(depth);
-          DBG_MSG("walking car.");
-          gc_walk(v->car, depth + 1);
-#ifdef DEBUG
-          printf("\n");
-          indent(depth);
-          DBG_MSG("walking cdr.");
-#endif
-          gc_walk(v->cdr, depth + 1);
-          break;
-        case V_CLOSURE:
-          indent(depth);
-          DBG_MSG("walking env.");
-          gc_walk(v->env, depth + 1);
-#ifdef DEBUG
-          printf("\n");
-          indent(depth);
-          DBG_MSG("walking code.");
-#endif
-          gc_walk(v->code, depth + 1);
-          break;
-        case V_UNALLOCATED:
-          fatal("gc_walk() on V_UNALLOCATED.\n");
+  gc_mark_push(v);
+  if (interp->marking) {
+    return;
+  }
+  interp->marking = 1;
+  while (interp->n_mark_stack > 0) {
+    v = interp->mark_stack[--interp->n_mark_stack];
+    switch (TYPE_OF(v)) {
+      case V_STREAM:
+        gc_mark_push(v->stream_rest);
+        gc_mark_push(v->stream_head);
+        break;
+      case V_CONS_CELL:
+        // The cdr goes first so the car is traversed first: a list then
+        // needs one slot per level of nesting, not per element.
+        gc_mark_push(v->cdr);
+        gc_mark_push(v->car);
+        break;
+      case V_CLOSURE:
+        if (interp->skip_closure_children) {
           break;
-      }
-    } else {
-      DBG_MSG("Already visited.");
+        }
+        gc_mark_push(v->arg_names);
+        gc_mark_push(v->env);
+        gc_mark_push(v->code);
+        break;
+      case V_CHANNEL:
+        channel_gc_walk(v->channel, depth + 1);
+        break;
+      case V_HASHTABLE:
+        table_gc_walk(v->hashtable, depth + 1);
+        break;
+      case V_MEMO:
+        memo_gc_walk(v->memo, depth + 1);
+        break;
     }
   }
+  interp->marking = 0;
 }
 
+// Frees unmarked cells and rebuilds the free lists.  Pages with no live cells
+// left go back to the free pages.
 void collect(void)
 {
+  PAGE *page;
+  uint64_t garbage;
   int i;
-  LISP_VALUE *last = NULL;
-  free_list_head = NULL;
-  n_free_values = 0;
-  for (i = 0; i < MAX_VALUES; i++) {
-    if (!mem[i].gc_mark) {
-      n_free_values += 1;
-      if (NULL == free_list_head) {
-        free_list_head = &mem[i];
-        free_list_head->next_free = NULL;
-        last = free_list_head;
-      } else {
-        last->next_free = &mem[i];
-        last->next_free->next_free = NULL;
-        last = last->next_free;
+  int w;
+  int n_live;
+  memset(interp->free_cells, 0, sizeof(interp->free_cells));
+  memset(interp->n_free_cells, 0, sizeof(interp->n_free_cells));
+  interp->free_pages = NULL;
+  interp->n_free_values = 0;
+  interp->gc_stats.n_live = 0;
+  interp->gc_stats.n_freed = 0;
+  // Walk downwards so the free lists come out in address order.
+  for (i = interp->n_pages_used - 1; i >= 0; --i) {
+    page = (PAGE *) (interp->heap + i*PAGE_SIZE);
+    n_live = 0;
+    if (V_UNALLOCATED != page->value_type) {
+      for (w = 0; w < PAGE_BITMAP_WORDS; ++w) {
+        garbage = page->allocated[w] & ~page->marked[w];
+        interp->gc_stats.n_freed += __builtin_popcountll(garbage);
+        while (0 != garbage) {
+          finalize_value(page_cell(page, w*64 + __builtin_ctzll(garbage)));
+          garbage &= garbage - 1;
+        }
+        page->allocated[w] &= page->marked[w];
+        n_live += __builtin_popcountll(page->allocated[w]);
       }
     }
+    interp->gc_stats.n_live += n_live;
+    if (0 == n_live) {
+      page->value_type = V_UNALLOCATED;
+      page->next = interp->free_pages;
+      interp->free_pages = page;
+    } else {
+      page_thread_free_cells(page);
+    }
   }
 }
 
-void protect_from_gc(LISP_VALUE *v)
+// Releases whatever a garbage cell owns outside of the heap.
+void finalize_value(LISP_VALUE *v)
 {
-  protect_stack[protect_stack_ptr++] = v;
+  switch (TYPE_OF(v)) {
+    case V_CHANNEL:
+      free(v->channel);
+      break;
+    case V_VECTOR:
+      vector_free(v->vector);
+      break;
+    case V_HASHTABLE:
+      table_free(v->hashtable);
+      break;
+    case V_STRING:
+      strbuf_release(v->strbuf);
+      break;
+    case V_PORT:
+      port_close(v->port);
+      free(v->port);
+      break;
+    case V_MEMO:
+      memo_free(v->memo);
+      break;
+  }
 }
 
-void unprotect_from_gc(void)
+void heap_init(void)
 {
-  protect_stack_ptr -= 1;
+  interp->n_pages_used = 0;
+  interp->free_pages = NULL;
+  memset(interp->free_cells, 0, sizeof(interp->free_cells));
+  memset(interp->n_free_cells, 0, sizeof(interp->n_free_cells));
+  interp->n_free_values = 0;
 }
 
-void init_free_list(void)
+// Takes the first cell off a free list that is known not to be empty.
+LISP_VALUE *cell_take(int slot)
 {
-  int i;
-  LISP_VALUE *v;
-  free_list_head = &mem[0];
-  for (i = 1; i < MAX_VALUES; ++i) {
-    mem[i - 1].next_free = &mem[i];
-    mem[i - 1].value_type = V_UNALLOCATED;
-  }
-  mem[MAX_VALUES - 1].next_free = NULL;
-  mem[MAX_VALUES - 1].value_type = V_UNALLOCATED;
-  n_free_values = 0;
-  for (v = free_list_head; NULL != v; v = v->next_free) {
-    n_free_values += 1;
+  LISP_VALUE *ret = interp->free_cells[slot];
+  interp->free_cells[slot] = ret->next_free;
+  BIT_SET(PAGE_OF(ret)->allocated, cell_index(ret));
+  interp->n_free_cells[slot] -= 1;
+  interp->n_free_values -= 1;
+  interp->gc_stats.n_allocated += 1;
+  if (interp->gc_stats.n_allocated == interp->next_sample) {
+    alloc_sample(slot);
   }
-#ifdef DEBUG
-  printf("Available values/cons cells = %d\n", n_free_values);
-#endif
+  TRACE_EVENT(TRACE_ALLOC, slot, type_name(1 << slot));
+  return ret;
 }
 
 LISP_VALUE *new_value(int value_type)
 {
-  LISP_VALUE *ret = free_list_head;
-  if (NULL == free_list_head) {
-    gc();
-    if (NULL == free_list_head) {
-      fatal("Memory overflow.\n");
+  int slot = type_slot(value_type);
+  LISP_VALUE *ret;
+  if (NULL == interp->free_cells[slot]) {
+    if (!page_add(value_type)) {
+      gc();
+      if (NULL == interp->free_cells[slot] && !page_add(value_type)) {
+        heap_census_print(stderr);
+        fatal("Memory overflow.\n");
+      }
     }
-    ret = free_list_head;
   }
-  free_list_head = free_list_head->next_free;
-  ret->value_type = value_type;
-  if (V_CONS_CELL == value_type) {
+  ret = cell_take(slot);
+  // The collector may walk a cell before its caller has filled it in.
+  if (V_CLOSURE == value_type) {
+    ret->arg_names = ret->env = ret->code = NULL;
+  } else if (V_CONS_CELL == value_type) {
     ret->car = ret->cdr = NULL;
   }
-  n_free_values -= 1;
   return ret;
 }
 
+// Number of cells of value_type that can be allocated without collecting.
+int64_t cells_available(int value_type)
+{
+  PAGE *page;
+  int64_t n_pages = HEAP_PAGES - interp->n_pages_used;
+  for (page = interp->free_pages; NULL != page; page = page->next) {
+    n_pages += 1;
+  }
+  return interp->n_free_cells[type_slot(value_type)] +
+    n_pages*((PAGE_SIZE - PAGE_HEADER_SIZE) >> cell_shift(value_type));
+}
+
+// Returns a list of n new cons cells ending in tail, with every car NULL for
+// the caller to fill in.  Room for all n is made up front, collecting at
+// most once, and the cells are taken off the free list in one run, so they
+// come out in address order.  Returns tail if n is 0, and NULL if the heap
+// cannot hold n more cells.
+LISP_VALUE *new_cons_list(int64_t n, LISP_VALUE *tail)
+{
+  int slot = type_slot(V_CONS_CELL);
+  LISP_VALUE *head = NULL;
+  LISP_VALUE *last = NULL;
+  LISP_VALUE *v;
+  if (n > cells_available(V_CONS_CELL)) {
+    gc();
+    if (n > cells_available(V_CONS_CELL)) {
+      error("Memory overflow: list too long.");
+      return NULL;
+    }
+  }
+  while (n-- > 0) {
+    if (NULL == interp->free_cells[slot]) {
+      page_add(V_CONS_CELL);
+    }
+    v = cell_take(slot);
+    v->car = v->cdr = NULL;
+    if (NULL == head) {
+      head = v;
+    } else {
+      last->cdr = v;
+    }
+    last = v;
+  }
+  if (NULL == head) {
+    return tail;
+  }
+  last->cdr = tail;
+  return head;
+}
+
+//------------------------------------------------------------------------------
+/// Code arena
+//
+// Program forms are read into the heap like any other value, then copied into
+// the code arena and the originals left to the collector.  Arena cells live
+// as long as the interpreter and are never marked, swept or traced: they
+// only ever point at other arena cells, so the collector loses nothing by
+// ignoring them (gc_walk() and gc_scan_range() only look at the heap).  The
+// arena has pages of its own, laid out like heap pages, and each form is
+// copied depth first so evaluating it walks memory mostly in address order.
+// Nothing writes to a form once it is copied.
+
+// Allocates a cell in the arena page for value_type, starting a new page
+// when that one is full.
+LISP_VALUE *code_new_value(int value_type)
+{
+  PAGE **current = &interp->code_pages[type_slot(value_type)];
+  PAGE *page = *current;
+  if (NULL == page || page->n_used == page->n_cells) {
+    if (NULL == (page = aligned_alloc(PAGE_SIZE, PAGE_SIZE))) {
+      fatal("Cannot allocate code arena.");
+    }
+    page_format(page, value_type);
+    page->next = interp->code_arena;
+    interp->code_arena = page;
+    *current = page;
+  }
+  BIT_SET(page->allocated, page->n_used);
+  return page_cell(page, page->n_used++);
+}
+
+// Returns a copy of the form v in the code arena.  v must be reader output:
+// conses, integers, symbols, strings and nil only.
+LISP_VALUE *code_copy(LISP_VALUE *v)
+{
+  LISP_VALUE *ret = NULL;
+  LISP_VALUE *tail = NULL;
+  LISP_VALUE *cell;
+  if (NULL == v) {
+    return NULL;
+  }
+  for (;;) {
+    cell = code_new_value(TYPE_OF(v));
+    if (NULL == ret) {
+      ret = cell;
+    } else {
+      tail->cdr = cell;
+    }
+    if (!IS_TYPE(v, V_CONS_CELL)) {
+      memcpy(cell, v, 1 << cell_shift(TYPE_OF(v)));
+      if (IS_TYPE(v, V_STRING)) {
+        // The copy views the buffer too, and outlives the original.
+        strbuf_retain(cell->strbuf);
+      }
+      break;
+    }
+    // The cons cell comes before the copy of its car, and the copy of its
+    // cdr after that.
+    cell->car = code_copy(v->car);
+    tail = cell;
+    v = v->cdr;
+  }
+  return ret;
+}
+
+void code_arena_free(INTERP *in)
+{
+  PAGE *page;
+  int i;
+  while (NULL != (page = in->code_arena)) {
+    in->code_arena = page->next;
+    for (i = 0; V_STRING == page->value_type && i < page->n_used; ++i) {
+      strbuf_release(page_cell(page, i)->strbuf);
+    }
+    free(page);
+  }
+}
+
 //------------------------------------------------------------------------------
 /// Environment
 //
@@ -502,9 +895,7 @@ LISP_VALUE *env_extend(LISP_VALUE *var_name, LISP_VALUE *var_value,
   LISP_VALUE *part1;
   LISP_VALUE *part2;
   part1 = cons(var_value, outer_env);
-  protect_from_gc(part1);
   part2 = cons(var_name, part1);
-  unprotect_from_gc();
   return part2;
 }
 
@@ -532,6 +923,12 @@ LISP_VALUE *env_fetch(LISP_VALUE *name, LISP_VALUE *env)
 int env_set(LISP_VALUE *name, LISP_VALUE *val, LISP_VALUE *env)
 {
   LISP_VALUE *e = env_search(name, env);
+  if (NULL != e && !IN_HEAP(e)) {
+    // The binding belongs to the interpreter that started a pmap; its heap
+    // must not point into ours.
+    error("Cannot set a variable captured from another heap.");
+    return 0;
+  }
   if (NULL != e) {
     e->cdr->car = val;
     return 1;
@@ -546,10 +943,8 @@ int env_set(LISP_VALUE *name, LISP_VALUE *val, LISP_VALUE *env)
 void global_env_init(LISP_VALUE *name, LISP_VALUE *value)
 {
   LISP_VALUE *value_part;
-  value_part = cons(value, global_env);
-  protect_from_gc(value_part);
-  global_env = cons(name, value_part);
-  unprotect_from_gc();
+  value_part = cons(value, interp->global_env);
+  interp->global_env = cons(name, value_part);
 }
 
 // This function may be safely called after any closure creation.
@@ -558,17 +953,9 @@ void global_env_extend(LISP_VALUE *name, LISP_VALUE *value)
 {
   LISP_VALUE *tmp0;
   LISP_VALUE *tmp1;
-  protect_from_gc(name);  // name
-  protect_from_gc(value); // value name
-  tmp0 = cons(value, global_env->cdr->cdr);
-  // value will be protected when tmp0 is protected, so it
-  // may be safely unprotected now.
-  unprotect_from_gc();  // name
-  protect_from_gc(tmp0); // tmp0 name
+  tmp0 = cons(value, interp->global_env->cdr->cdr);
   tmp1 = cons(name, tmp0);
-  unprotect_from_gc();  // name
-  unprotect_from_gc();  //
-  global_env->cdr->cdr = tmp1;
+  interp->global_env->cdr->cdr = tmp1;
 }
 
 //------------------------------------------------------------------------------
@@ -591,7 +978,7 @@ LISP_VALUE *stx_closure(LISP_VALUE *clo_expr, LISP_VALUE *env)
   LISP_VALUE *ret;
   LISP_VALUE *args;
   arg_names = car(clo_expr);
-  if (!IS_TYPE(arg_names, V_CONS_CELL)) {
+  if (!IS_TYPE(arg_names, V_CONS_CELL | V_NIL)) {
     error("Argument list to closure should be () or (arg ...)");
     return NULL;
   }
@@ -613,7 +1000,7 @@ LISP_VALUE *stx_setq(LISP_VALUE *name, LISP_VALUE *val, LISP_VALUE *env)
 {
   LISP_VALUE *curr_val = env_fetch(name, env);
   if (NULL == curr_val) {
-    if (global_env == env) {
+    if (interp->global_env == env) {
       DBG_MSG("extending global env.");
       global_env_extend(name, val);
       return val;
@@ -621,17 +1008,21 @@ LISP_VALUE *stx_setq(LISP_VALUE *name, LISP_VALUE *val, LISP_VALUE *env)
       error("Cannot extend global env in closure.");
       return NULL;
     }
-  } else {
-    env_set(name, val, env);
-    return val;
+  } else if (!env_set(name, val, env)) {
+    return NULL;
   }
+  return val;
 }
 
-LISP_VALUE *fn_add(LISP_VALUE *x, LISP_VALUE *y, LISP_VALUE *env)
+// (if test then else): nil is false, anything else true.
+LISP_VALUE *stx_if(LISP_VALUE *test, LISP_VALUE *then, LISP_VALUE *otherwise,
+                   LISP_VALUE *env)
 {
-  LISP_VALUE *res = new_value(V_INT);
-  res->intnum = x->intnum + y->intnum;
-  return res;
+  LISP_VALUE *v = eval(test, env);
+  if (NULL == v) {
+    return NULL;
+  }
+  return eval(IS_TYPE(v, V_NIL) ? otherwise : then, env);
 }
 
 BUILTIN_INFO builtin_list[] = {
@@ -663,6 +1054,15 @@ BUILTIN_INFO builtin_list[] = {
     .builtin_1 = stx_closure,
     ARG_UNEVALED, V_CONS_CELL
   },
+  [4] = {
+    .name      = "if",
+    .type      = BUILTIN_SYNTAX,
+    .n_args    = 3,
+    .builtin_3 = stx_if,
+    ARG_UNEVALED, V_ANY,
+    ARG_UNEVALED, V_ANY,
+    ARG_UNEVALED, V_ANY
+  },
   [MAX_BUILTINS - 1] = {"", BUILTIN_NOTUSED, -1, NULL}, // end of list marker
 };
 
@@ -695,25 +1095,55 @@ BUILTIN_INFO builtin_list[] = {
 // is slightly more complicated than simple array initialization which
 // is all that is required for builtin syntax.  Builtin functions must
 // be bound to a variable in the global environment (ex. "+" is bound to
-// fn_add()).
+// fn_add()).  That binding is made per interpreter by bind_builtin_fns();
+// this only fills in builtin_list[] and must run before any interpreter is
+// created.
 int install_builtin_fn(char *var_name, char *descriptive_name, void *fn,
                        int n_args)
 {
   if (builtin_index < MAX_BUILTINS - 1) {
-    LISP_VALUE *var = create_symbol(var_name);
-    LISP_VALUE *val;
     strncpy_with_nul(builtin_list[builtin_index].name, descriptive_name, SYM_SIZE - 1);
+    strncpy_with_nul(builtin_list[builtin_index].var_name, var_name, SYM_SIZE - 1);
     builtin_list[builtin_index].type = BUILTIN_FUNCTION;
     builtin_list[builtin_index].n_args = n_args;
     SWITCH_16(n_args, SET_BUILTIN_FN);
-    val = create_builtin(&builtin_list[builtin_index]);
     builtin_index += 1;
-    global_env_init(var, val);
     return builtin_index - 1;
   }
   return -1;
 }
 
+// Installs a function taking min_args or more arguments.  The type of every
+// argument is set with set_builtin_arg_info(idx, 0, ...).
+int install_variadic_fn(char *var_name, char *descriptive_name, builtin_fn_v fn,
+                        int min_args)
+{
+  int idx = install_builtin_fn(var_name, descriptive_name, NULL, 0);
+  if (idx >= 0) {
+    builtin_list[idx].type = BUILTIN_VARIADIC;
+    builtin_list[idx].n_args = min_args;
+    builtin_list[idx].builtin_v = fn;
+  }
+  return idx;
+}
+
+// Binds every builtin function in builtin_list[] in the current
+// interpreter's global environment.
+void bind_builtin_fns(void)
+{
+  int i;
+  LISP_VALUE *var;
+  LISP_VALUE *val;
+  for (i = N_SYNTAX_KEYWORDS; i < builtin_index; ++i) {
+    if (BUILTIN_FUNCTION == builtin_list[i].type ||
+        BUILTIN_VARIADIC == builtin_list[i].type) {
+      var = create_symbol(builtin_list[i].var_name);
+      val = create_builtin(&builtin_list[i]);
+      global_env_init(var, val);
+    }
+  }
+}
+
 char *type_name(int t)
 {
   switch (t) {
@@ -729,6 +1159,20 @@ char *type_name(int t)
       return "nil";
     case V_BUILTIN:
       return "builtin";
+    case V_CHANNEL:
+      return "channel";
+    case V_VECTOR:
+      return "vector";
+    case V_HASHTABLE:
+      return "hashtable";
+    case V_STRING:
+      return "string";
+    case V_STREAM:
+      return "stream";
+    case V_PORT:
+      return "port";
+    case V_MEMO:
+      return "memo";
     default:
       return "unknown";
   }
@@ -736,11 +1180,11 @@ char *type_name(int t)
 
 void arg_type_error(char *fn_name, int i_arg, LISP_VALUE *arg, int expected_type)
 {
-  printf("ERROR: incorrect type to argument %d of %s\n"
-         "       expected: %s\n"
-         "       recieved: %s\n"
-         "       value is: ", i_arg, fn_name, type_name(expected_type),
-         type_name(arg->value_type));
+  fprintf(interp->output, "ERROR: incorrect type to argument %d of %s\n"
+          "       expected: %s\n"
+          "       recieved: %s\n"
+          "       value is: ", i_arg, fn_name, type_name(expected_type),
+          type_name(TYPE_OF(arg)));
   print_lisp_value(arg, 1);
 }
 
@@ -773,8 +1217,78 @@ LISP_VALUE *call_builtin(BUILTIN_INFO *pinfo, LISP_VALUE *args[],
                          LISP_VALUE *env)
 {
   int n_args = pinfo->n_args < 0 ? 1 : pinfo->n_args;
+  PROFILE *prof = interp->profile;
+  LISP_VALUE *ret = NULL;
+  TRACE_EVENT(TRACE_BUILTIN_ENTER, 0, builtin_name(pinfo));
+  if (NULL != prof) {
+    prof_enter(prof, pinfo, NULL, pinfo);
+  }
   SWITCH_16(n_args, CALL_BUILTIN_WITH_ARG_ARRAY);
-  return NULL;
+  if (NULL != prof) {
+    prof_exit(prof);
+  }
+  TRACE_EVENT(TRACE_BUILTIN_EXIT, 0, builtin_name(pinfo));
+  return ret;
+}
+
+// Takes the next argument of a variadic call into *arg, checking its type.
+// Returns 1, 0 if there are no more, or -1 if evaluating or checking it
+// failed.
+int arg_next(VARIADIC_ARGS *args, LISP_VALUE **arg)
+{
+  LISP_VALUE *v;
+  int expected_type = args->pinfo->arg_types[1];
+  if (!IS_TYPE(args->list, V_CONS_CELL)) {
+    return 0;
+  }
+  v = car(args->list);
+  if (args->evaluate && NULL == (v = eval(v, args->env))) {
+    return -1;
+  }
+  if (!IS_TYPE(v, expected_type)) {
+    arg_type_error(args->pinfo->name, args->i_arg, v, expected_type);
+    return -1;
+  }
+  args->list = cdr(args->list);
+  args->i_arg += 1;
+  *arg = v;
+  return 1;
+}
+
+// Calls a variadic builtin on arglist: expressions to evaluate, or values
+// if evaluate is 0.  The builtin folds over the list itself with
+// arg_next(), so time spent evaluating the arguments is profiled as part of
+// the call, as it is for syntax.
+LISP_VALUE *call_variadic(BUILTIN_INFO *pinfo, LISP_VALUE *arglist,
+                          int evaluate, LISP_VALUE *env)
+{
+  VARIADIC_ARGS args;
+  PROFILE *prof;
+  LISP_VALUE *ret;
+  LISP_VALUE *p;
+  args.pinfo = pinfo;
+  args.list = arglist;
+  args.env = env;
+  args.evaluate = evaluate;
+  args.n_args = 0;
+  args.i_arg = 0;
+  for (p = arglist; IS_TYPE(p, V_CONS_CELL); p = cdr(p)) {
+    args.n_args += 1;
+  }
+  if (args.n_args < pinfo->n_args) {
+    error("Insufficient number of arguments to function.");
+    return NULL;
+  }
+  TRACE_EVENT(TRACE_BUILTIN_ENTER, 0, builtin_name(pinfo));
+  if (NULL != (prof = interp->profile)) {
+    prof_enter(prof, pinfo, NULL, pinfo);
+    ret = (*pinfo->builtin_v)(&args, env);
+    prof_exit(prof);
+  } else {
+    ret = (*pinfo->builtin_v)(&args, env);
+  }
+  TRACE_EVENT(TRACE_BUILTIN_EXIT, 0, builtin_name(pinfo));
+  return ret;
 }
 
 void set_builtin_arg_info(int builtin_idx, int arg_idx, int eval_type,
@@ -790,39 +1304,36 @@ void set_builtin_arg_info(int builtin_idx, int arg_idx, int eval_type,
 LISP_VALUE *eval_builtin(BUILTIN_INFO *pinfo, LISP_VALUE *arglist,
                          LISP_VALUE *env)
 {
-  LISP_VALUE *arg_array[16];
+  LISP_VALUE *arg_array[MAX_ARGS];
   LISP_VALUE *unevaled_arg;
   LISP_VALUE *passed_arg;
-  LISP_VALUE *ret;
+  LISP_VALUE *ret = NULL;
   int n_args, i_arg;
+  if (BUILTIN_VARIADIC == pinfo->type) {
+    return call_variadic(pinfo, arglist, 1, env);
+  }
+  // The stack is scanned for roots: slots this call does not fill must not
+  // keep the arguments of an earlier call alive.
+  memset(arg_array, 0, sizeof(arg_array));
   // pinfo->n_args < 0 means to treat entire argument list as a single argument.
   n_args = pinfo->n_args < 0 ? 1 : pinfo->n_args;
-  if (pinfo->n_args < 0) {
-    unevaled_arg = arglist;
-    if (NULL == (passed_arg = check_arg(pinfo, 0, unevaled_arg, env))) {
-      return NULL;
-    }
-    arg_array[0] = passed_arg;
-  } else {
-    for (i_arg = 0; i_arg < n_args; ++i_arg) {
-      if (!IS_TYPE(arglist, V_CONS_CELL)) {
-        error("Insufficient number of arguments to function.");
-        return NULL;
-      }
+  for (i_arg = 0; i_arg < n_args; ++i_arg) {
+    if (pinfo->n_args < 0) {
+      unevaled_arg = arglist;
+    } else if (!IS_TYPE(arglist, V_CONS_CELL)) {
+      error("Insufficient number of arguments to function.");
+      break;
+    } else {
       unevaled_arg = car(arglist);
       arglist = cdr(arglist);
-      if (NULL == (passed_arg = check_arg(pinfo, i_arg, unevaled_arg, env))) {
-        return NULL;
-      }
-      arg_array[i_arg] = passed_arg;
     }
+    if (NULL == (passed_arg = check_arg(pinfo, i_arg, unevaled_arg, env))) {
+      break;
+    }
+    arg_array[i_arg] = passed_arg;
   }
-  for (i_arg = 0; i_arg < n_args; ++i_arg) {
-    protect_from_gc(arg_array[i_arg]);
-  }
-  ret = call_builtin(pinfo, arg_array, env);
-  for (i_arg = 0; i_arg < n_args; ++i_arg) {
-    unprotect_from_gc();
+  if (i_arg == n_args) {
+    ret = call_builtin(pinfo, arg_array, env);
   }
   return ret;
 }
@@ -858,44 +1369,151 @@ int is_syntax(LISP_VALUE *expr)
   return BUILTIN_SYNTAX == pinfo->type;
 }
 
-// LISP_VALUE eval_seq(LISP_VALUE *seq, LISP_VALUE *env)
-// {
-//   LISP_VALUE ret;
-//   if (IS_TYPE(seq, V_NIL)) {
-//     ret = the_nil_value;
-//   } else {
-//
-//
-// LISP_VALUE eval_closure_application(LISP_VALUE *clo, LISP_VALUE *arg_list,
-//                                     LISP_VALUE *env)
-// {
-//   if (IS_TYPE(arg_list, V_CONS_CELL)) {
-//     FOR_LIST(args, clo->arg_names) {
-//       evaled_arg =
-//     }
-//   } else if (IS_TYPE(arg_list, V_NIL)) {
-//     ret = new_value(V_NIL);
-//   } else {
-//     error("Dotted pair used as argument.");
-//     return NULL;
-//   }
-// }
+// Evaluates each form of seq in env and returns the value of the last one.
+LISP_VALUE *eval_seq(LISP_VALUE *seq, LISP_VALUE *env)
+{
+  LISP_VALUE *ret = NULL;
+  LISP_VALUE *form;
+  if (IS_TYPE(seq, V_NIL)) {
+    return create_nil();
+  }
+  FOR_LIST(form, seq) {
+    if (NULL == (ret = eval(car(form), env))) {
+      return NULL;
+    }
+  }
+  return ret;
+}
+
+// Binds the closure's argument names to the already evaluated values in
+// arg_values and evaluates its body.
+LISP_VALUE *apply_closure(LISP_VALUE *clo, LISP_VALUE *arg_values)
+{
+  LISP_VALUE *env = clo->env;
+  LISP_VALUE *names;
+  LISP_VALUE *values = arg_values;
+  LISP_VALUE *ret = NULL;
+  PROFILE *prof;
+  FOR_LIST(names, clo->arg_names) {
+    if (!IS_TYPE(values, V_CONS_CELL)) {
+      break;
+    }
+    env = env_extend(car(names), car(values), env);
+    values = cdr(values);
+  }
+  if (IS_TYPE(names, V_CONS_CELL)) {
+    error("Insufficient number of arguments to closure.");
+  } else if (!IS_TYPE(values, V_NIL)) {
+    error("Too many arguments to closure.");
+  } else if (NULL != (prof = interp->profile)) {
+    prof_enter(prof, clo->code, clo, NULL);
+    ret = eval_seq(clo->code, env);
+    prof_exit(prof);
+  } else {
+    ret = eval_seq(clo->code, env);
+  }
+  return ret;
+}
+
+// Calls a builtin function with already evaluated arguments.
+LISP_VALUE *apply_builtin(BUILTIN_INFO *pinfo, LISP_VALUE *arg_values)
+{
+  LISP_VALUE *arg_array[MAX_ARGS];
+  int i_arg;
+  if (BUILTIN_VARIADIC == pinfo->type) {
+    return call_variadic(pinfo, arg_values, 0, interp->global_env);
+  }
+  memset(arg_array, 0, sizeof(arg_array));
+  if (BUILTIN_FUNCTION != pinfo->type || pinfo->n_args < 0) {
+    error("Cannot apply syntax.");
+    return NULL;
+  }
+  for (i_arg = 0; i_arg < pinfo->n_args; ++i_arg) {
+    if (!IS_TYPE(arg_values, V_CONS_CELL)) {
+      error("Insufficient number of arguments to function.");
+      return NULL;
+    }
+    arg_array[i_arg] = car(arg_values);
+    if (!IS_TYPE(arg_array[i_arg], pinfo->arg_types[2*i_arg + 1])) {
+      arg_type_error(pinfo->name, i_arg, arg_array[i_arg],
+                     pinfo->arg_types[2*i_arg + 1]);
+      return NULL;
+    }
+    arg_values = cdr(arg_values);
+  }
+  return call_builtin(pinfo, arg_array, interp->global_env);
+}
+
+// Applies a closure or builtin function to a list of evaluated arguments.
+LISP_VALUE *apply_fn(LISP_VALUE *fn, LISP_VALUE *arg_values)
+{
+  if (IS_TYPE(fn, V_CLOSURE)) {
+    return apply_closure(fn, arg_values);
+  } else if (IS_TYPE(fn, V_BUILTIN)) {
+    return apply_builtin(fn->func_info, arg_values);
+  } else if (IS_TYPE(fn, V_MEMO)) {
+    return memo_apply(fn, arg_values);
+  }
+  error("Application of non-closure.");
+  return NULL;
+}
+
+LISP_VALUE *apply_fn_1(LISP_VALUE *fn, LISP_VALUE *arg)
+{
+  return apply_fn(fn, cons(arg, create_nil()));
+}
+
+// Evaluates the arguments and applies a closure or memo to them.
+LISP_VALUE *eval_closure_application(LISP_VALUE *clo, LISP_VALUE *arglist,
+                                     LISP_VALUE *env)
+{
+  LISP_VALUE *head;
+  LISP_VALUE *tail;
+  LISP_VALUE *arg;
+  LISP_VALUE *ret = NULL;
+  head = new_value(V_CONS_CELL);
+  tail = head;
+  FOR_LIST(arglist, arglist) {
+    if (NULL == (arg = eval(car(arglist), env))) {
+      break;
+    }
+    tail->cdr = cons(arg, NULL);
+    tail = tail->cdr;
+  }
+  if (IS_TYPE(arglist, V_CONS_CELL)) {
+    // An argument failed to evaluate and has already reported why.
+  } else if (!IS_TYPE(arglist, V_NIL)) {
+    error("Dotted pair used as argument.");
+  } else {
+    tail->cdr = create_nil();
+    ret = apply_fn(clo, head->cdr);
+  }
+  return ret;
+}
 
 LISP_VALUE *eval_application(LISP_VALUE *expr, LISP_VALUE *env)
 {
   LISP_VALUE *fn;
   LISP_VALUE *ret = NULL;
-  int n_args = 0;
+  LISP_VALUE *outer_form;
+  // eval() recurses on the C stack; give up before running off its end.
+  if ((char *) __builtin_frame_address(0) < interp->current_task->stack_limit) {
+    error("Stack overflow.");
+    return NULL;
+  }
+  outer_form = interp->alloc_form;
+  interp->alloc_form = expr;
+  TRACE_EVENT(TRACE_EVAL_ENTER, 0, form_name(expr));
   fn = eval(car(expr), env);
-  protect_from_gc(fn);
   if (IS_TYPE(fn, V_BUILTIN)) {
     ret = eval_builtin(fn->func_info, cdr(expr), env);
-  } else if (IS_TYPE(fn, V_CLOSURE)) {
-    //ret = eval_closure_application(fn, cdr(expr), env);
+  } else if (IS_TYPE(fn, V_CLOSURE | V_MEMO)) {
+    ret = eval_closure_application(fn, cdr(expr), env);
   } else {
     error("Application of non-closure.\n");
   }
-  unprotect_from_gc();
+  TRACE_EVENT(TRACE_EVAL_EXIT, 0, form_name(expr));
+  interp->alloc_form = outer_form;
   return ret;
 }
 
@@ -903,20 +1521,17 @@ LISP_VALUE *eval(LISP_VALUE *expr, LISP_VALUE *env)
 {
   LISP_VALUE *ret = NULL;
   if (NULL != expr) {
-    protect_from_gc(expr);
     if (IS_SELF_EVAUATING(expr)) {
       ret = expr;
     } else if (IS_TYPE(expr, V_SYMBOL)) {
       ret = eval_var(expr, env);
     } else if (is_syntax(expr)) {
       ret = eval_syntax(expr, env);
-      print_lisp_value(ret, 1);
     } else if (IS_TYPE(expr, V_CONS_CELL)) {
       ret = eval_application(expr, env);
     } else {
       fatal("Unknown form.");
     }
-    unprotect_from_gc();
   }
   return ret;
 }
@@ -934,29 +1549,412 @@ LISP_VALUE *eval_var(LISP_VALUE *expr, LISP_VALUE *env)
 LISP_VALUE *eval_syntax(LISP_VALUE *expr, LISP_VALUE *env)
 {
   BUILTIN_INFO *pinfo = get_builtin_info(car(expr));
+  LISP_VALUE *outer_form = interp->alloc_form;
+  LISP_VALUE *ret;
+  interp->alloc_form = expr;
+  TRACE_EVENT(TRACE_EVAL_ENTER, 0, pinfo->name);
   // since expr passed is_syntax() we know NULL != pinfo
-  return eval_builtin(pinfo, cdr(expr), env);
+  ret = eval_builtin(pinfo, cdr(expr), env);
+  TRACE_EVENT(TRACE_EVAL_EXIT, 0, pinfo->name);
+  interp->alloc_form = outer_form;
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+/// Interpreters
+
+// Registers every builtin function in builtin_list[].  Called once, before
+// any interpreter exists.
+void install_builtins(void)
+{
+  install_arith_builtins();
+  install_pmap_builtins();
+  install_task_builtins();
+  install_vector_builtins();
+  install_table_builtins();
+  install_string_builtins();
+  install_stream_builtins();
+  install_list_builtins();
+  install_profile_builtins();
+  install_gc_stats_builtins();
+  install_census_builtins();
+  install_perf_builtins();
+  install_trace_builtins();
+  install_memo_builtins();
+}
+
+// Creates an interpreter with a fresh heap and global environment and makes
+// it the current interpreter of the calling thread.
+INTERP *interp_create(FILE *output)
+{
+  INTERP *in = calloc(1, sizeof(INTERP));
+  if (NULL == in) {
+    fatal("Cannot allocate interpreter.");
+  }
+  // Pages are only committed once page_add() hands them out.
+  in->heap = mmap(NULL, HEAP_PAGES*PAGE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == in->heap) {
+    fatal("Cannot allocate interpreter.");
+  }
+  in->current_char = '\n';
+  in->show_prompt = 1;
+  in->output = output;
+  in->gc_stats.last_end = now_ns();
+  in->next_sample = UINT64_MAX;
+  if (alloc_sample_every > 0 &&
+      NULL != (in->alloc_sites = calloc(ALLOC_SITES, sizeof(ALLOC_SITE)))) {
+    in->next_sample = alloc_sample_every;
+  }
+  interp = in;
+  trace_thread_start();
+  sched_init();
+  heap_init();
+  interp->global_env = new_value(V_NIL);
+  interp->t_symbol = create_symbol("t");
+  bind_builtin_fns();
+  return in;
+}
+
+void interp_destroy(INTERP *in)
+{
+  PAGE *page;
+  int i;
+  int j;
+  sched_destroy(in);
+  code_arena_free(in);
+  for (i = 0; i < in->n_pages_used; ++i) {
+    page = (PAGE *) (in->heap + i*PAGE_SIZE);
+    for (j = 0; V_UNALLOCATED != page->value_type && j < page->n_cells; ++j) {
+      if (BIT_TEST(page->allocated, j)) {
+        finalize_value(page_cell(page, j));
+      }
+    }
+  }
+  if (interp == in) {
+    interp = NULL;
+  }
+  munmap(in->heap, HEAP_PAGES*PAGE_SIZE);
+  free(in->profile_mem);
+  free(in->gc_stats.pauses);
+  free(in->alloc_sites);
+  free(in->mark_stack);
+  perf_close(in->perf);
+  trace_thread_stop(in);
+  free(in);
+}
+
+//------------------------------------------------------------------------------
+/// Batch runner
+//
+// "ml -j N file ..." runs each file in its own interpreter on one of N
+// threads.  A file's output is collected in memory and written to stdout in
+// one piece when the file finishes, so output from different files never
+// interleaves.
+
+void *batch_worker(void *arg)
+{
+  BATCH *batch = arg;
+  char *out_buf;
+  size_t out_len;
+  FILE *out;
+  INTERP *in;
+  int i;
+  for (;;) {
+    i = __atomic_fetch_add(&batch->next_file, 1, __ATOMIC_RELAXED);
+    if (i >= batch->n_files) {
+      break;
+    }
+    if (NULL == (out = open_memstream(&out_buf, &out_len))) {
+      fatal("Cannot allocate output buffer.");
+    }
+    in = interp_create(out);
+    if (load_file(batch->files[i]) < 0) {
+      __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+    }
+    interp_destroy(in);
+    fclose(out);
+    pthread_mutex_lock(&batch->output_lock);
+    fwrite(out_buf, 1, out_len, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->output_lock);
+    free(out_buf);
+  }
+  return NULL;
+}
+
+// Returns 0 if every file loaded successfully.
+int run_batch(char **files, int n_files, int n_jobs)
+{
+  BATCH batch;
+  pthread_t *threads;
+  int i;
+  if (n_jobs > n_files) {
+    n_jobs = n_files;
+  }
+  batch.files = files;
+  batch.n_files = n_files;
+  batch.next_file = 0;
+  batch.failed = 0;
+  pthread_mutex_init(&batch.output_lock, NULL);
+  threads = malloc(n_jobs*sizeof(pthread_t));
+  for (i = 0; i < n_jobs; ++i) {
+    if (0 != pthread_create(&threads[i], NULL, batch_worker, &batch)) {
+      fatal("Cannot create thread.");
+    }
+  }
+  for (i = 0; i < n_jobs; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&batch.output_lock);
+  return batch.failed;
+}
+
+//------------------------------------------------------------------------------
+/// Loading
+
+// Reads an entire file into a malloc()ed buffer.  Returns NULL (and reports
+// the error) if the file cannot be read.
+char *read_file(char *path, long *len)
+{
+  FILE *f;
+  char *buf;
+  if (NULL == (f = fopen(path, "rb"))) {
+    fprintf(stderr, "ERROR: cannot open %s\n", path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf = malloc(*len + 1);
+  if (NULL == buf || (long) fread(buf, 1, *len, f) != *len) {
+    fprintf(stderr, "ERROR: cannot read %s\n", path);
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  buf[*len] = '\0';
+  fclose(f);
+  return buf;
+}
+
+// Parses every form in buf[0..len) with read_lisp_value() and returns them as
+// a list.  Returns NULL if any form fails to read.
+LISP_VALUE *read_forms(char *buf, long len)
+{
+  FILE *saved_stream = interp->input_stream;
+  int saved_char = interp->current_char;
+  int saved_prompt = interp->show_prompt;
+  LISP_VALUE *head;
+  LISP_VALUE *tail;
+  LISP_VALUE *form;
+  LISP_VALUE *ret = NULL;
+  if (NULL == (interp->input_stream = fmemopen(buf, len, "r"))) {
+    interp->input_stream = saved_stream;
+    return NULL;
+  }
+  interp->show_prompt = 0;
+  interp->current_char = ' ';
+  head = new_value(V_CONS_CELL);
+  tail = head;
+  for (;;) {
+    skip_blanks();
+    if (EOF == interp->current_char) {
+      tail->cdr = create_nil();
+      ret = head->cdr;
+      break;
+    }
+    if (NULL == (form = read_lisp_value())) {
+      break;
+    }
+    tail->cdr = cons(form, NULL);
+    tail = tail->cdr;
+  }
+  ret = code_copy(ret);
+  fclose(interp->input_stream);
+  interp->input_stream = saved_stream;
+  interp->current_char = saved_char;
+  interp->show_prompt = saved_prompt;
+  return ret;
+}
+
+// Evaluates a list of top level forms in the global environment, printing
+// each result, then runs any tasks they spawned.
+void eval_forms(LISP_VALUE *forms)
+{
+  LISP_VALUE *form;
+  LISP_VALUE *value;
+  FOR_LIST(form, forms) {
+    if (NULL != (value = eval(car(form), interp->global_env))) {
+      fprintf(interp->output, "result =>");
+      print_lisp_value(value, 1);
+      fflush(interp->output);
+    }
+  }
+  sched_drain();
+}
+
+// Loads and evaluates a source file.  The parsed forms are looked up in the
+// form cache by content hash first, so unchanged files skip the reader.
+int load_file(char *path)
+{
+  char *buf;
+  long len;
+  uint64_t hash;
+  LISP_VALUE *forms;
+  int outer_phase = perf_phase(PERF_READ);
+  if (NULL == (buf = read_file(path, &len))) {
+    perf_phase(outer_phase);
+    return -1;
+  }
+  hash = cache_hash(buf, len);
+  if (NULL == (forms = cache_fetch(hash))) {
+    if (NULL == (forms = read_forms(buf, len))) {
+      fprintf(stderr, "ERROR: failed to read %s\n", path);
+      free(buf);
+      perf_phase(outer_phase);
+      return -1;
+    }
+    cache_store(hash, forms);
+  }
+  free(buf);
+  perf_phase(PERF_EVAL);
+  eval_forms(forms);
+  perf_phase(outer_phase);
+  return 0;
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [options] [file ...]\n"
+          "  --cache-dir DIR   store parsed forms in DIR\n"
+          "                    (default $ML_CACHE_DIR or ~/.cache/micro-lisp)\n"
+          "  --no-cache        neither read nor write the form cache\n"
+          "  --clear-cache     remove all cached forms before loading\n"
+          "  -j N              run the files on N threads, each file in its\n"
+          "                    own interpreter\n"
+          "  --serve SOCKET    load the files, then evaluate requests on a Unix\n"
+          "                    domain socket in pre-forked workers\n"
+          "  --workers N       number of --serve workers (default 4)\n"
+          "  --client SOCKET   send the files (or stdin) to a --serve process\n"
+          "                    and print the results\n"
+          "  --profile         time every call and write a report to stderr and\n"
+          "                    collapsed stacks to $ML_PROFILE_OUT\n"
+          "                    (default profile.folded)\n"
+          "  --perf            count cycles, instructions, cache and branch\n"
+          "                    misses per phase (read, eval, GC) and report\n"
+          "                    them at exit\n"
+          "With no files, forms are read from standard input.\n", prog);
+  exit(1);
 }
 
 int main(int argc, char **argv)
 {
   LISP_VALUE *expr;
   LISP_VALUE *value;
-  LISP_VALUE *name;
-  int idx;
-  init_free_list();
-  global_env = new_value(V_NIL);
-  idx = install_builtin_fn("+", "add", fn_add, 2);
-  DBG_FN_PRINT_VAR(idx, "%d");
-  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
-  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  char **files;
+  int n_files = 0;
+  int clear_cache = 0;
+  int n_jobs = 1;
+  char *serve_path = NULL;
+  char *client_path = NULL;
+  int n_workers = 4;
+  int profile = 0;
+  int perf = 0;
+  int i;
+  files = malloc(argc*sizeof(char *));
+  for (i = 1; i < argc; ++i) {
+    if (STREQ(argv[i], "--no-cache")) {
+      cache_enabled = 0;
+    } else if (STREQ(argv[i], "--clear-cache")) {
+      clear_cache = 1;
+    } else if (STREQ(argv[i], "--cache-dir") && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (STREQ(argv[i], "-j") && i + 1 < argc) {
+      if ((n_jobs = atoi(argv[++i])) < 1) {
+        usage(argv[0]);
+      }
+    } else if (STREQ(argv[i], "--serve") && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (STREQ(argv[i], "--client") && i + 1 < argc) {
+      client_path = argv[++i];
+    } else if (STREQ(argv[i], "--workers") && i + 1 < argc) {
+      if ((n_workers = atoi(argv[++i])) < 1) {
+        usage(argv[0]);
+      }
+    } else if (STREQ(argv[i], "--profile")) {
+      profile = 1;
+    } else if (STREQ(argv[i], "--perf")) {
+      perf = 1;
+    } else if ('-' == argv[i][0]) {
+      usage(argv[0]);
+    } else {
+      files[n_files++] = argv[i];
+    }
+  }
+  if (NULL != client_path) {
+    return run_client(client_path, files, n_files);
+  }
+  cache_init();
+  if (clear_cache) {
+    cache_clear();
+  }
+  install_builtins();
+  if (n_jobs > 1 && n_files > 0) {
+    return run_batch(files, n_files, n_jobs);
+  }
+  interp_create(stdout);
+  if (gc_log) {
+    atexit(gc_stats_at_exit);
+  }
+  if (alloc_sample_every > 0) {
+    atexit(alloc_sites_at_exit);
+  }
+  if (perf && perf_open()) {
+    atexit(perf_at_exit);
+  }
+  if (profile && !prof_start()) {
+    return 1;
+  }
+  if (n_files > 0) {
+    for (i = 0; i < n_files; ++i) {
+      if (load_file(files[i]) < 0) {
+        return 1;
+      }
+    }
+    if (NULL == serve_path) {
+      if (profile) {
+        prof_stop();
+      }
+      return 0;
+    }
+  }
+  if (NULL != serve_path) {
+    return run_server(serve_path, n_workers);
+  }
   for (;;) {
+    perf_phase(PERF_READ);
     expr = read_lisp_value();
+    if (NULL == expr && EOF == interp->current_char) {
+      break;
+    }
+    expr = code_copy(expr);
     DBG_MSG("unevaluated =>");
     DBG_PRINT_LISP_VAR(expr);
-    if (NULL != (value = eval(expr, global_env))) {
-      printf("result =>");
+    perf_phase(PERF_EVAL);
+    value = eval(expr, interp->global_env);
+    perf_phase(PERF_OTHER);
+    if (NULL != value) {
+      fprintf(interp->output, "result =>");
       print_lisp_value(value, 1);
     }
   }
+  perf_phase(PERF_OTHER);
+  sched_drain();
+  if (profile) {
+    prof_stop();
+  }
+  return 0;
 }
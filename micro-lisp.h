@@ -7,22 +7,61 @@ enum LISP_TYPE {
   V_CLOSURE     = 0x08,
   V_NIL         = 0x10,
   V_BUILTIN     = 0x20,
-  V_UNALLOCATED = 0x40
+  V_UNALLOCATED = 0x40,
+  V_CHANNEL     = 0x80,
+  V_VECTOR      = 0x100,
+  V_HASHTABLE   = 0x200,
+  V_STRING      = 0x400,
+  V_STREAM      = 0x800,
+  V_PORT        = 0x1000,
+  V_MEMO        = 0x2000
 };
 
-#define V_ANY (V_INT | V_SYMBOL | V_CONS_CELL | V_CLOSURE | V_NIL | V_BUILTIN)
+#define V_ANY (V_INT | V_SYMBOL | V_CONS_CELL | V_CLOSURE | V_NIL | V_BUILTIN | \
+               V_CHANNEL | V_VECTOR | V_HASHTABLE | V_STRING | V_STREAM | \
+               V_PORT | V_MEMO)
+
+// What apply_fn() can call.
+#define V_CALLABLE (V_CLOSURE | V_BUILTIN | V_MEMO)
 
 TDS(LISP_VALUE);
 TDS(BUILTIN_INFO);
+TDS(INTERP);
+TDS(BATCH);
+TDS(PMAP_JOB);
+TDS(PMAP_WORKER);
+TDS(TASK);
+TDS(CHANNEL);
+TDS(PAGE);
+TDS(VECTOR);
+TDS(HASHTABLE);
+TDS(TABLE_ENTRY);
+TDS(MEMO);
+TDS(MEMO_ENTRY);
+TDS(STRBUF);
+TDS(PORT);
+TDS(PROFILE);
+TDS(PROF_FN);
+TDS(PROF_NODE);
+TDS(PROF_FRAME);
+TDS(GC_STATS);
+TDS(HEAP_CENSUS);
+TDS(ALLOC_SITE);
+TDS(PERF_EVENT);
+TDS(PERF_COUNTERS);
+TDS(TRACE_RECORD);
+TDS(TRACE_RING);
+TDS(TRACE_RING_HEADER);
+TDS(VARIADIC_ARGS);
 
 #include "builtin-macros.h"
 
+// A cell's type is not stored in the cell but in the header of the page it
+// lives in (see TYPE_OF()), and cells are only as big as their type needs.
 struct LISP_VALUE {
-  unsigned gc_mark;
-  unsigned value_type;
   union {
     // V_INT
-    int intnum;
+    int64_t intnum;
     // V_SYMBOL
     // Symbol names occupy the same size as two pointers.
 #   define SYM_SIZE (2*sizeof(void *))
@@ -40,12 +79,36 @@ struct LISP_VALUE {
     };
     // V_BUILTIN
     BUILTIN_INFO *func_info;
+    // V_CHANNEL
+    CHANNEL *channel;
+    // V_VECTOR
+    VECTOR *vector;
+    // V_HASHTABLE
+    HASHTABLE *hashtable;
+    // V_STRING
+    // A view of str_length bytes of strbuf, starting at str_start.
+    struct {
+      STRBUF *strbuf;
+      int64_t str_start;
+      int64_t str_length;
+    };
+    // V_STREAM
+    struct {
+      struct LISP_VALUE *stream_head;
+      // The rest of the stream (a stream or nil) once it has been forced.
+      // Until then the list (how . args) that computes it (see stream.c).
+      struct LISP_VALUE *stream_rest;
+    };
+    // V_PORT
+    PORT *port;
+    // V_MEMO
+    MEMO *memo;
     // V_UNALLOCATED
     struct LISP_VALUE *next_free;
   };
 };
 
-#define IS_TYPE(val, type) (NULL != (val) && ((val)->value_type & type))
+#define IS_TYPE(val, type) (NULL != (val) && (TYPE_OF(val) & (type)))
 
 #define IS_ATOM(val) (IS_TYPE(val, V_INT) || IS_TYPE(val, V_SYMBOL) ||  \
                       IS_TYPE(val, V_NIL))
@@ -68,7 +131,8 @@ struct LISP_VALUE {
 #define IS_ATOM_CHAR(c)                         \
   (IS_ALPHANUM(c) ||                            \
    IS_DIGIT(c)    ||                            \
-   IN_RANGE((c), '!', '\'') ||                  \
+   '!' == (c)     ||                            \
+   IN_RANGE((c), '#', '\'') ||                  \
    IN_RANGE((c), '*', '/') ||                   \
    IN_RANGE((c), ':', '@') ||                   \
    IN_RANGE((c), '[', '`') ||                   \
@@ -77,31 +141,67 @@ struct LISP_VALUE {
 #define KW_EQ(x, strconst)                                      \
   (IS_TYPE((x), V_SYMBOL) && STREQ((x)->symbol, (strconst)))
 
-#define IS_SELF_EVAUATING(x) (IS_TYPE((x), V_INT) || IS_TYPE((x), V_NIL))
+#define IS_SELF_EVAUATING(x) (IS_TYPE((x), V_INT) || IS_TYPE((x), V_NIL) || \
+                              IS_TYPE((x), V_STRING))
 
 #define ARG_EVALED 0
 #define ARG_UNEVALED 1
 
-// size of mem[] array.
-#define MAX_VALUES 100000
+// Heap page size.  Must be a power of two no bigger than the system page,
+// since heaps are mmap()ed and pages found by masking a cell's address.
+#define PAGE_SIZE 4096
+
+// Number of pages in a heap (3.2MB).
+#define HEAP_PAGES 800
 
-// size of protect_stack[]
-#define MAX_PROTECTED 1024
+// 64-bit words in a page's bitmaps: one bit per cell of the smallest size.
+#define PAGE_BITMAP_WORDS (PAGE_SIZE/8/64)
+
+// Number of entries in per-type tables, indexed by type_slot().
+#define N_TYPE_SLOTS 16
+
+// Number of slots in a new hash table.  Capacities are powers of two.
+#define TABLE_INITIAL_CAPACITY 8
+
+// Slots of the old array moved into the new one by each operation on a
+// hash table that is being rehashed.
+#define TABLE_MIGRATE_STEP 8
 
 // Maximum number of built-in keywords(syntax) and functions.
 #define MAX_BUILTINS 128
 
+// Address space reserved for the C stack of a green thread.  Pages are only
+// committed as the stack grows into them.  Each task also takes a few cells
+// of the fixed HEAP_PAGES heap and two mappings (the stack and its guard
+// page), so an interpreter runs out of heap somewhere past 30000 live tasks,
+// and of mappings near 32000 with the default vm.max_map_count of 65530.
+#define TASK_STACK_SIZE (1024*1024)
+
+// C stack kept free below the deepest eval_application() frame, for the
+// builtins and the collector it calls.  Recursing any deeper is reported as
+// a stack overflow.
+#define STACK_MARGIN (64*1024)
+
+// Initial number of entries of a mark stack (see gc_walk()).
+#define MARK_STACK_INITIAL 1024
+
+// Number of released task stacks kept around for new tasks.
+#define TASK_STACK_POOL 64
+
 // Number of syntax keywords.  Non-syntax builtins go into builtin_info[]
 // following these.
-#define N_SYNTAX_KEYWORDS 4
+#define N_SYNTAX_KEYWORDS 5
 
 // Maximum number of arguments a built-in keyword or function
 // may have.
 #define MAX_ARGS 16
 
+// A BUILTIN_VARIADIC function takes n_args or more evaluated arguments, any
+// number of them, all of the type given for argument 0.
 enum {
   BUILTIN_SYNTAX,
   BUILTIN_FUNCTION,
+  BUILTIN_VARIADIC,
   BUILTIN_NOTUSED
 };
 
@@ -127,6 +227,545 @@ struct BUILTIN_INFO {
     builtin_fn_14 builtin_14;
     builtin_fn_15 builtin_15;
     builtin_fn_16 builtin_16;
+    builtin_fn_v  builtin_v;
   };
   int arg_types[MAX_ARGS*2];
+  // Name the function is bound to in the global environment.  Unused for
+  // syntax.
+  char var_name[SYM_SIZE];
+};
+
+// Arguments of a call to a BUILTIN_VARIADIC function.  arg_next() walks
+// the argument list, evaluating each element first when the call came from
+// eval_builtin(), so no call copies its arguments anywhere.
+struct VARIADIC_ARGS {
+  BUILTIN_INFO *pinfo;
+  // Arguments not taken yet.
+  LISP_VALUE *list;
+  LISP_VALUE *env;
+  // Zero if the list holds values already (apply_builtin()).
+  int evaluate;
+  int n_args;
+  // Index of the next argument.
+  int i_arg;
+};
+
+// Collector telemetry of one interpreter (gcstats.c).  Times are in ns.
+struct GC_STATS {
+  uint64_t n_collections;
+  // Cells handed out by cell_take() since the interpreter was created, and
+  // the count when the last collection started.
+  uint64_t n_allocated;
+  uint64_t allocated_at_last;
+  // When the last collection ended (or the interpreter was created).
+  uint64_t last_end;
+  // The last collection: time spent in mark(), sweep() and collect(), cells
+  // that survived and cells freed, and cells allocated per second of
+  // mutator time before it.
+  uint64_t mark_time;
+  uint64_t sweep_time;
+  uint64_t collect_time;
+  int64_t n_live;
+  int64_t n_freed;
+  uint64_t alloc_rate;
+  uint64_t total_pause;
+  uint64_t total_freed;
+  // Pause of every collection, for percentiles.  malloc()ed.
+  uint64_t *pauses;
+  int64_t pauses_capacity;
+};
+
+extern int gc_log;
+
+// Everything belonging to one interpreter: its heap, GC roots, reader and
+// global environment.  builtin_list[] is shared by all interpreters and is
+// only written before the first one is created.  Each thread runs at most
+// one interpreter at a time, reached through the thread-local `interp'.
+struct INTERP {
+  // HEAP_PAGES pages, PAGE_SIZE aligned.  This is the "source" for all
+  // LISP_VALUEs.
+  char *heap;
+  // Pages heap[0..n_pages_used) have been handed out at least once.
+  int n_pages_used;
+  // Pages with no live cells, linked through PAGE.next.
+  PAGE *free_pages;
+  // Free cells of each type, indexed by type_slot().
+  LISP_VALUE *free_cells[N_TYPE_SLOTS];
+  // Length of each free list.
+  int n_free_cells[N_TYPE_SLOTS];
+  // Counter for reporting.
+  int n_free_values;
+  // Current input character not yet processed.
+  int current_char;
+  // Stream the reader takes characters from.  NULL means stdin.
+  FILE *input_stream;
+  // Print the "N>" prompt when the reader starts a new line.  Turned off
+  // while loading files.
+  int show_prompt;
+  // Nesting level of lists.
+  int nest_level;
+  // Where results are printed.
+  FILE *output;
+  // Global environment.  Gets special treatment since everything points to
+  // it.
+  LISP_VALUE *global_env;
+  // The symbol t returned by the predicates (lisp_bool()).  A GC root like
+  // global_env.
+  LISP_VALUE *t_symbol;
+  // Pages of the code arena holding program forms (see code_copy()), newest
+  // first, and the page being filled for each type.
+  PAGE *code_arena;
+  PAGE *code_pages[N_TYPE_SLOTS];
+  // Green thread scheduler (task.c).  main_task is the interpreter's own
+  // thread of control and runs on the thread's stack.
+  TASK *main_task;
+  TASK *current_task;
+  // Runnable tasks, in FIFO order, linked through TASK.next.
+  TASK *run_head;
+  TASK *run_tail;
+  // Every task that has not been reaped, linked through TASK.next_task.
+  TASK *all_tasks;
+  int next_task_id;
+  // Unused task stacks kept for reuse.
+  char *free_stacks[TASK_STACK_POOL];
+  int n_free_stacks;
+  // Call profile being recorded (profile.c), or NULL, and the allocation
+  // reused by every recording.
+  PROFILE *profile;
+  PROFILE *profile_mem;
+  GC_STATS gc_stats;
+  // Values marked by gc_walk() whose children are still to be marked, and
+  // whether a gc_walk() is emptying it.
+  LISP_VALUE **mark_stack;
+  int64_t n_mark_stack;
+  int64_t mark_stack_size;
+  int marking;
+  // Set while heap_census() marks from the stacks: closures are marked but
+  // not what they capture.
+  int skip_closure_children;
+  // Allocation sampling (census.c): the form being evaluated, the value of
+  // gc_stats.n_allocated at which the next cell is sampled (UINT64_MAX when
+  // not sampling) and the sampled cells per form, ALLOC_SITES slots.
+  LISP_VALUE *alloc_form;
+  uint64_t next_sample;
+  ALLOC_SITE *alloc_sites;
+  // Hardware counters of this thread (perf.c), or NULL.
+  PERF_COUNTERS *perf;
+  // Event trace ring of this thread (trace.c), or NULL.
+  TRACE_RING *trace;
+};
+
+extern __thread INTERP *interp;
+
+// True if v was allocated from in's heap.
+#define IN_HEAP_OF(v, in)                                       \
+  ((char *) (v) >= (in)->heap &&                                \
+   (char *) (v) < (in)->heap + HEAP_PAGES*PAGE_SIZE)
+
+// True if v was allocated from the current interpreter's heap.
+#define IN_HEAP(v) IN_HEAP_OF((v), interp)
+
+// Header at the start of every heap and code arena page.  Cells follow at
+// PAGE_HEADER_SIZE.
+struct PAGE {
+  // Type of every cell in the page.  V_UNALLOCATED for a free heap page.
+  unsigned value_type;
+  // Cells are 1 << cell_shift bytes.
+  unsigned cell_shift;
+  int n_cells;
+  // Cells handed out so far (code arena pages only).
+  int n_used;
+  // Next free page, or next page of the code arena.
+  PAGE *next;
+  uint64_t allocated[PAGE_BITMAP_WORDS];
+  uint64_t marked[PAGE_BITMAP_WORDS];
+};
+
+#define PAGE_HEADER_SIZE ((sizeof(PAGE) + 31) & ~(size_t) 31)
+
+#define PAGE_OF(v) ((PAGE *) ((uintptr_t) (v) & ~(uintptr_t) (PAGE_SIZE - 1)))
+
+#define PAGE_CELLS(page) ((char *) (page) + PAGE_HEADER_SIZE)
+
+#define TYPE_OF(v) (PAGE_OF(v)->value_type)
+
+#define BIT_TEST(bits, i) (((bits)[(i) >> 6] >> ((i) & 63)) & 1)
+
+#define BIT_SET(bits, i) ((bits)[(i) >> 6] |= (uint64_t) 1 << ((i) & 63))
+
+#define BIT_CLEAR(bits, i) ((bits)[(i) >> 6] &= ~((uint64_t) 1 << ((i) & 63)))
+
+// Work shared by the threads of the batch runner ("ml -j N").
+struct BATCH {
+  char **files;
+  int n_files;
+  // Index of the next file to hand out.
+  int next_file;
+  int failed;
+  pthread_mutex_t output_lock;
+};
+
+// Form cache settings (cache.c).
+extern char *cache_dir;
+extern int cache_enabled;
+
+// One worker thread of a pmap/preduce call.  Chunks top..bottom-1 are still
+// waiting in this worker's deque; the owner pops from the bottom and idle
+// workers steal from the top.
+struct PMAP_WORKER {
+  PMAP_JOB *job;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int top;
+  int bottom;
+  // The worker's private interpreter.  Kept alive after the thread exits
+  // until its results have been copied into the caller's heap.
+  INTERP *heap;
+};
+
+struct PMAP_JOB {
+  LISP_VALUE *fn;
+  // Elements of the input list (in the caller's heap).
+  LISP_VALUE **items;
+  int n_items;
+  int chunk_size;
+  int n_chunks;
+  // Non-zero for preduce: results[] then holds one value per chunk.
+  int reduce;
+  // Results, each in the heap of the worker that computed it.
+  LISP_VALUE **results;
+  INTERP **result_heaps;
+  PMAP_WORKER *workers;
+  int n_workers;
+  FILE *output;
+  int failed;
+};
+
+enum {
+  TASK_RUNNABLE,
+  TASK_BLOCKED,
+  TASK_DONE
+};
+
+// A green thread.  Runs (fn) on its own C stack, and is suspended with
+// swapcontext() when it yields or blocks on a channel.
+struct TASK {
+  int id;
+  int state;
+  LISP_VALUE *fn;
+  ucontext_t context;
+  // mmap()ed region: guard page, then the C stack.  NULL for the main task.
+  char *stack;
+  // Live part of the C stack while suspended, scanned for GC roots:
+  // stack_lo is below the task's last frame, stack_top is where the stack
+  // starts.  stack_lo is NULL until the task first runs.
+  char *stack_lo;
+  char *stack_top;
+  // Lowest address eval_application() may run at: STACK_MARGIN above the
+  // end of the stack.
+  char *stack_limit;
+  // Link in the run queue or in the channel queue the task is blocked on.
+  TASK *next;
+  // Queue the task is blocked on, if any.
+  TASK **waiting_on;
+  // Set when the task was woken up because every task was blocked.
+  int deadlocked;
+  TASK *next_task;
+};
+
+// Bounded FIFO channel.  The cell's payload; freed when the cell is
+// collected.
+struct CHANNEL {
+  int capacity;
+  int count;
+  int head;
+  // Tasks blocked in send (buffer full) and recv (buffer empty).
+  TASK *senders;
+  TASK *receivers;
+  LISP_VALUE *buffer[];
+};
+
+// Vector kernels (vector.c): dst[i] = a[i] op b[i], and folds over a and b.
+typedef void (*vector_binop_fn)(int64_t *dst, int64_t *a, int64_t *b, int64_t n);
+typedef int64_t (*vector_fold_fn)(int64_t *a, int64_t *b, int64_t n);
+
+// Unboxed integers.  The cell's payload; freed when the cell is collected.
+// Vectors made by the builtins hold 64-bit elements in `storage'; those made
+// by mmap-ints view a read-only mapping of a file instead.
+struct VECTOR {
+  int64_t length;
+  // Bytes per element: 8, or 4 for a file of 32-bit integers.
+  int elem_size;
+  // Length of the file mapping, or 0 if the elements are in storage.
+  size_t map_size;
+  union {
+    int64_t *data;
+    int32_t *data32;
+  };
+  int64_t storage[];
+};
+
+// Marks a deleted slot in the old array of a hash table being rehashed.
+#define TABLE_TOMBSTONE ((LISP_VALUE *) 1)
+
+// A slot of a hash table.  key is NULL for an empty slot.
+struct TABLE_ENTRY {
+  LISP_VALUE *key;
+  LISP_VALUE *value;
+  uint64_t hash;
+};
+
+// Open addressing hash table with linear probing, keyed by integers and
+// symbols.  The cell's payload; freed when the cell is collected.
+struct HASHTABLE {
+  // Entries in both arrays.
+  int64_t count;
+  int64_t capacity;
+  TABLE_ENTRY *entries;
+  // While growing: the previous array, whose slots below migrate_pos have
+  // been moved into entries.  NULL otherwise.
+  TABLE_ENTRY *old_entries;
+  int64_t old_capacity;
+  int64_t migrate_pos;
+};
+
+// Cached results of (memoize f) kept by default, and how deep into nested
+// lists of arguments memo_hash() looks.
+#define MEMO_DEFAULT_LIMIT 65536
+#define MEMO_HASH_DEPTH 8
+// Elements of each list memo_hash() looks at.
+#define MEMO_HASH_ITEMS 32
+
+// Entry evicted when a memoized function's cache is full.
+enum {
+  MEMO_LRU,
+  MEMO_FIFO
+};
+
+// A cached result.  prev and next link the entries from the most to the
+// least recently used (MEMO_LRU) or inserted (MEMO_FIFO).
+struct MEMO_ENTRY {
+  // The argument list.
+  LISP_VALUE *key;
+  LISP_VALUE *value;
+  uint64_t hash;
+  int32_t prev;
+  int32_t next;
+};
+
+// A memoized function.  The cell's payload; freed when the cell is
+// collected.
+struct MEMO {
+  LISP_VALUE *fn;
+  int policy;
+  int64_t limit;
+  // entries[0..count) are in use; the array grows up to limit entries.
+  int64_t count;
+  int64_t capacity;
+  MEMO_ENTRY *entries;
+  // Open addressing index of entries, -1 for an empty slot.  index_size is
+  // a power of 2 at least twice capacity.
+  int32_t *index;
+  int64_t index_size;
+  // Most and least recent entries, -1 when empty.
+  int32_t head;
+  int32_t tail;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// Bytes of one or more strings, allocated outside the heap.  Shared by every
+// string cell viewing it, and freed when the last of them is collected.
+// Bytes below `used' never change once written; appending to the string that
+// ends at `used' fills the free space in place (see string_append()).
+struct STRBUF {
+  // Number of string cells (heap or code arena) viewing the buffer.
+  int64_t refs;
+  int64_t used;
+  int64_t capacity;
+  char data[];
 };
+
+// File a stream reads from.  The cell's payload; the file is closed when the
+// stream reaches its end or the cell is collected.
+struct PORT {
+  FILE *file;
+  // Reader lookahead (see INTERP.current_char) between forms.
+  int current_char;
+};
+
+// Limits of a call profile.  Functions past PROF_MAX_FNS are counted as
+// "(other)"; calls past PROF_MAX_DEPTH are not timed.  PROF_MAX_FNS must be
+// a power of 2.
+#define PROF_MAX_FNS 1024
+#define PROF_MAX_NODES 16384
+#define PROF_MAX_DEPTH 4096
+
+// A closure (keyed by its code) or builtin (keyed by its BUILTIN_INFO) seen
+// by the profiler.  Times are in TSC ticks.
+struct PROF_FN {
+  void *key;
+  // First closure seen with this code, kept alive so the key is not reused.
+  LISP_VALUE *clo;
+  char name[48];
+  uint64_t calls;
+  // Time inside the function, counting recursive calls once.
+  uint64_t incl;
+  // Time inside the function but not inside functions it called.
+  uint64_t excl;
+  // Number of calls in progress.
+  int active;
+};
+
+// A node of the calling context tree: a function called from a path of
+// callers.  Node 0 is the root.
+struct PROF_NODE {
+  int fn;
+  int parent;
+  uint64_t excl;
+};
+
+struct PROF_FRAME {
+  int fn;
+  int node;
+  uint64_t start;
+  // Time spent in the calls this one made.
+  uint64_t child;
+};
+
+struct PROFILE {
+  PROF_FN fns[PROF_MAX_FNS];
+  int n_fns;
+  PROF_NODE nodes[PROF_MAX_NODES];
+  int n_nodes;
+  // Open addressing index of nodes by (parent, fn); 0 is an empty slot,
+  // otherwise the node number plus 1.
+  int node_index[2*PROF_MAX_NODES];
+  PROF_FRAME stack[PROF_MAX_DEPTH];
+  int depth;
+  // Calls made while the stack was full.
+  int lost_depth;
+  // TSC and CLOCK_MONOTONIC (in ns) when recording started, to convert
+  // ticks to time.
+  uint64_t start_ticks;
+  uint64_t start_ns;
+};
+
+// Live cells of each type, indexed by type_slot(), and how many of them
+// are reachable from global_env, from the C stacks of the tasks without
+// going through a closure, and only through the environments and code of
+// closures reachable from the stacks.  The rest are garbage not yet
+// collected.
+struct HEAP_CENSUS {
+  int64_t allocated[N_TYPE_SLOTS];
+  int64_t from_global[N_TYPE_SLOTS];
+  int64_t from_stacks[N_TYPE_SLOTS];
+  int64_t from_closures[N_TYPE_SLOTS];
+};
+
+// Size of the table of allocation sites.  A power of 2.
+#define ALLOC_SITES 4096
+
+// Cells of one type sampled while evaluating form.  form is NULL for an
+// empty slot; TOPLEVEL_FORM stands for allocations outside any form.
+struct ALLOC_SITE {
+  LISP_VALUE *form;
+  int type;
+  uint64_t samples;
+};
+
+#define TOPLEVEL_FORM ((LISP_VALUE *) 1)
+
+extern uint64_t alloc_sample_every;
+
+// Phases that hardware counts are charged to.  PERF_GC_MARK covers mark()
+// and sweep(), which does the marking; PERF_GC_COLLECT covers collect().
+enum {
+  PERF_OTHER,
+  PERF_READ,
+  PERF_EVAL,
+  PERF_GC_MARK,
+  PERF_GC_COLLECT,
+  PERF_N_PHASES
+};
+
+#define PERF_N_EVENTS 5
+
+// A hardware event for perf_event_open().
+struct PERF_EVENT {
+  char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+// Counters of one thread, opened as a group so they count over the same
+// intervals.
+struct PERF_COUNTERS {
+  // Group leader: the first event that could be opened.
+  int leader;
+  // Descriptor of each event of perf_events[], or -1 if it is not
+  // available, and its position in the values read from the group.
+  int fd[PERF_N_EVENTS];
+  int value_index[PERF_N_EVENTS];
+  int n_open;
+  int phase;
+  // Counts at the last phase change.
+  uint64_t last[PERF_N_EVENTS];
+  uint64_t counts[PERF_N_PHASES][PERF_N_EVENTS];
+};
+
+// Kinds of TRACE_RECORD.  Each _ENTER is followed by its _EXIT on the same
+// thread unless the ring wrapped in between.
+enum {
+  TRACE_EVAL_ENTER = 1,
+  TRACE_EVAL_EXIT,
+  TRACE_BUILTIN_ENTER,
+  TRACE_BUILTIN_EXIT,
+  TRACE_ALLOC,
+  TRACE_GC_START,
+  TRACE_GC_END
+};
+
+// Records per thread.  A power of 2.
+#define TRACE_RECORDS (1 << 18)
+
+// Threads traced at once.  Rings of finished threads are reused.
+#define TRACE_MAX_RINGS 64
+
+// One event.  aux is the type slot for TRACE_ALLOC, the cells allocated so
+// far for TRACE_GC_START and the cells freed for TRACE_GC_END.  name is the
+// form's head symbol, the builtin or the cell type, and is not terminated
+// if it fills the array.
+struct TRACE_RECORD {
+  uint64_t tsc;
+  uint32_t type;
+  uint32_t aux;
+  char name[SYM_SIZE];
+};
+
+struct TRACE_RING {
+  int in_use;
+  uint64_t tid;
+  // TSC and CLOCK_MONOTONIC when the ring was claimed, to convert ticks.
+  uint64_t start_tsc;
+  uint64_t start_ns;
+  // Records written; the next goes to records[n_written % TRACE_RECORDS].
+  uint64_t n_written;
+  TRACE_RECORD records[TRACE_RECORDS];
+};
+
+// A dump is TRACE_MAGIC, then for each ring with records a header and its
+// n_records records, oldest first.
+#define TRACE_MAGIC "MLTRACE1"
+
+struct TRACE_RING_HEADER {
+  uint64_t tid;
+  uint64_t start_tsc;
+  uint64_t start_ns;
+  uint64_t end_tsc;
+  uint64_t end_ns;
+  uint64_t n_records;
+};
+
+extern char *trace_path;
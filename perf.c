@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Hardware performance counters
+//
+// With --perf the main interpreter's thread opens the events below with
+// perf_event_open() and perf_phase() charges what they counted to the phase
+// that was running: reading (and the form cache), evaluation, the marking
+// part of gc() or collect().  The counters are read once per phase change,
+// that is per top-level form and per collection, so they cost nothing in
+// between.  Totals are printed at exit and returned by (perf-counters).
+//
+// Events the CPU or kernel cannot count are left out, and if none can be
+// opened (no PMU in a VM, perf_event_paranoid, seccomp) a note is printed
+// and the run goes on without counters.  Only the main thread counts, so
+// work done by pmap workers is not included.
+
+PERF_EVENT perf_events[PERF_N_EVENTS] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"l1d-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"llc-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+char *perf_phase_names[PERF_N_PHASES] = {
+  "other", "read", "eval", "gc-mark", "gc-collect"
+};
+
+// attr is a struct perf_event_attr.
+int perf_open_event(void *attr, int group_fd)
+{
+  // This thread, any CPU.
+  return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+// Opens the counters for the calling thread.  Returns 0, after saying why,
+// if none are available.
+int perf_open(void)
+{
+  struct perf_event_attr attr;
+  PERF_COUNTERS *pc = calloc(1, sizeof(PERF_COUNTERS));
+  int err = 0;
+  int i;
+  if (NULL == pc) {
+    error("Cannot allocate perf counters.");
+    return 0;
+  }
+  pc->leader = -1;
+  for (i = 0; i < PERF_N_EVENTS; ++i) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.disabled = -1 == pc->leader;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    pc->fd[i] = perf_open_event(&attr, pc->leader);
+    pc->value_index[i] = -1;
+    if (pc->fd[i] < 0) {
+      err = errno;
+      continue;
+    }
+    if (-1 == pc->leader) {
+      pc->leader = pc->fd[i];
+    }
+    pc->value_index[i] = pc->n_open++;
+  }
+  if (0 == pc->n_open) {
+    fprintf(stderr, "Performance counters unavailable: %s\n", strerror(err));
+    free(pc);
+    return 0;
+  }
+  pc->phase = PERF_OTHER;
+  interp->perf = pc;
+  ioctl(pc->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  perf_read(pc, pc->last);
+  return 1;
+}
+
+void perf_close(PERF_COUNTERS *pc)
+{
+  int i;
+  if (NULL != pc) {
+    for (i = 0; i < PERF_N_EVENTS; ++i) {
+      if (pc->fd[i] >= 0) {
+        close(pc->fd[i]);
+      }
+    }
+    free(pc);
+  }
+}
+
+// Reads the current count of each open event into values.
+void perf_read(PERF_COUNTERS *pc, uint64_t *values)
+{
+  uint64_t buf[1 + PERF_N_EVENTS];
+  int i;
+  if (read(pc->leader, buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t)) {
+    return;
+  }
+  for (i = 0; i < PERF_N_EVENTS; ++i) {
+    if (pc->value_index[i] >= 0) {
+      values[i] = buf[1 + pc->value_index[i]];
+    }
+  }
+}
+
+// Charges the counts since the last change to the running phase and makes
+// phase the running one.  Returns the phase that was running, to be
+// restored.
+int perf_phase(int phase)
+{
+  PERF_COUNTERS *pc = interp->perf;
+  uint64_t now[PERF_N_EVENTS] = {0};
+  int outer;
+  int i;
+  if (NULL == pc) {
+    return PERF_OTHER;
+  }
+  perf_read(pc, now);
+  for (i = 0; i < PERF_N_EVENTS; ++i) {
+    pc->counts[pc->phase][i] += now[i] - pc->last[i];
+    pc->last[i] = now[i];
+  }
+  outer = pc->phase;
+  pc->phase = phase;
+  return outer;
+}
+
+void perf_report(FILE *out)
+{
+  PERF_COUNTERS *pc = interp->perf;
+  uint64_t *c;
+  int phase;
+  int i;
+  perf_phase(pc->phase);
+  fprintf(out, "%-10s", "phase");
+  for (i = 0; i < PERF_N_EVENTS; ++i) {
+    fprintf(out, " %14s", perf_events[i].name);
+  }
+  fprintf(out, " %6s\n", "IPC");
+  for (phase = 0; phase < PERF_N_PHASES; ++phase) {
+    c = pc->counts[phase];
+    fprintf(out, "%-10s", perf_phase_names[phase]);
+    for (i = 0; i < PERF_N_EVENTS; ++i) {
+      if (pc->fd[i] < 0) {
+        fprintf(out, " %14s", "-");
+      } else {
+        fprintf(out, " %14llu", (unsigned long long) c[i]);
+      }
+    }
+    if (pc->fd[0] >= 0 && pc->fd[1] >= 0 && c[0] > 0) {
+      fprintf(out, " %6.2f", (double) c[1]/c[0]);
+    }
+    fprintf(out, "\n");
+  }
+  if (pc->fd[1] >= 0 && interp->gc_stats.n_allocated > 0) {
+    fprintf(out, "eval instructions per cell allocated: %.1f\n",
+            (double) pc->counts[PERF_EVAL][1]/interp->gc_stats.n_allocated);
+  }
+}
+
+// atexit() handler for the main interpreter.
+void perf_at_exit(void)
+{
+  if (NULL != interp && NULL != interp->perf) {
+    perf_report(stderr);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Performance counter built-ins
+
+// (perf-counters): ((phase cycles instructions l1d-misses llc-misses
+// branch-misses) ...), -1 for the events that are not available, or nil
+// without --perf.
+LISP_VALUE *fn_perf_counters(LISP_VALUE *env)
+{
+  PERF_COUNTERS *pc = interp->perf;
+  LISP_VALUE *ret = create_nil();
+  LISP_VALUE *row;
+  int phase;
+  int i;
+  if (NULL == pc) {
+    return ret;
+  }
+  perf_phase(pc->phase);
+  for (phase = PERF_N_PHASES - 1; phase >= 0; --phase) {
+    row = create_nil();
+    for (i = PERF_N_EVENTS - 1; i >= 0; --i) {
+      row = cons(create_intnum(pc->fd[i] < 0 ? -1 : pc->counts[phase][i]),
+                 row);
+    }
+    row = cons(create_symbol(perf_phase_names[phase]), row);
+    ret = cons(row, ret);
+  }
+  return ret;
+}
+
+void install_perf_builtins(void)
+{
+  install_builtin_fn("perf-counters", "perf-counters", fn_perf_counters, 0);
+}
@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Parallel map
+//
+// (pmap f list) applies f to every element of list and (preduce f init list)
+// folds list with an associative f, both on worker threads.  The list is cut
+// into chunks which are dealt out to the workers' deques; a worker that runs
+// out of chunks steals from the other end of another worker's deque.
+//
+// Every worker has its own interpreter and heap.  Workers only read the
+// caller's heap (the closure, its environment and the list) and never write
+// to it: gc_walk() does not follow pointers out of the current heap,
+// env_set() refuses to modify bindings owned by another heap, table-put!
+// and table-del! refuse to modify its tables, stream-rest refuses to force
+// its streams, send and recv refuse its channels and a memo owned by it
+// just calls its function.  The caller is blocked while the workers run, so
+// none of the caller's cells can move or be collected.  Once all workers
+// are done, the caller copies the results into its own heap and the worker
+// heaps are thrown away.
+//
+// The number of workers is taken from $ML_PMAP_THREADS, defaulting to the
+// number of online CPUs.  With a single worker everything runs on the
+// calling thread.
+
+// Chunks per worker.  More chunks balance better; fewer steal less.
+#define PMAP_CHUNKS_PER_WORKER 8
+
+int pmap_thread_count(void)
+{
+  char *env = getenv("ML_PMAP_THREADS");
+  long n = NULL != env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n;
+}
+
+LISP_VALUE *pmap_apply1(LISP_VALUE *fn, LISP_VALUE *x)
+{
+  return apply_fn(fn, list1(x));
+}
+
+LISP_VALUE *pmap_apply2(LISP_VALUE *fn, LISP_VALUE *x, LISP_VALUE *y)
+{
+  return apply_fn(fn, list2(x, y));
+}
+
+// Takes the next chunk for worker w: its own most recent chunk, or failing
+// that the oldest chunk of another worker.  Returns -1 when no work is left.
+int pmap_next_chunk(PMAP_JOB *job, int w)
+{
+  PMAP_WORKER *self = &job->workers[w];
+  PMAP_WORKER *victim;
+  int chunk = -1;
+  int i;
+  pthread_mutex_lock(&self->lock);
+  if (self->top < self->bottom) {
+    chunk = --self->bottom;
+  }
+  pthread_mutex_unlock(&self->lock);
+  for (i = 1; chunk < 0 && i < job->n_workers; ++i) {
+    victim = &job->workers[(w + i) % job->n_workers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom) {
+      chunk = victim->top++;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return chunk;
+}
+
+// Runs one chunk, storing its result(s) in job->results[].  held is a list
+// (in the worker's heap) that keeps the results alive until the caller has
+// copied them.
+int pmap_run_chunk(PMAP_JOB *job, int chunk, LISP_VALUE *held)
+{
+  int lo = chunk*job->chunk_size;
+  int hi = lo + job->chunk_size;
+  LISP_VALUE *acc;
+  int i;
+  if (hi > job->n_items) {
+    hi = job->n_items;
+  }
+  if (job->reduce) {
+    acc = job->items[lo];
+    for (i = lo + 1; i < hi && NULL != acc; ++i) {
+      acc = pmap_apply2(job->fn, acc, job->items[i]);
+    }
+    if (NULL == acc) {
+      return -1;
+    }
+    job->results[chunk] = acc;
+    job->result_heaps[chunk] = interp;
+    held->cdr = cons(acc, held->cdr);
+  } else {
+    for (i = lo; i < hi; ++i) {
+      if (NULL == (acc = pmap_apply1(job->fn, job->items[i]))) {
+        return -1;
+      }
+      job->results[i] = acc;
+      job->result_heaps[i] = interp;
+      held->cdr = cons(acc, held->cdr);
+    }
+  }
+  return 0;
+}
+
+void *pmap_worker(void *arg)
+{
+  PMAP_WORKER *self = arg;
+  PMAP_JOB *job = self->job;
+  LISP_VALUE *held;
+  int chunk;
+  self->heap = interp_create(job->output);
+  held = new_value(V_CONS_CELL);
+  while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED) &&
+         (chunk = pmap_next_chunk(job, self - job->workers)) >= 0) {
+    if (pmap_run_chunk(job, chunk, held) < 0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  // held keeps the results reachable while the worker runs.  Afterwards the
+  // heap is kept, untouched, until pmap_run() has copied them out of it.
+  interp = NULL;
+  return NULL;
+}
+
+// Copies the keys and values of a hash table moved out of from's heap.
+// Hashes only depend on what a key holds, so every entry keeps its slot.
+void pmap_copy_table(HASHTABLE *t, INTERP *from)
+{
+  TABLE_ENTRY *e;
+  int64_t i;
+  for (i = 0; i < t->capacity + t->old_capacity; ++i) {
+    e = i < t->capacity ? &t->entries[i] : &t->old_entries[i - t->capacity];
+    if (NULL != e->key && TABLE_TOMBSTONE != e->key) {
+      e->key = pmap_copy(e->key, from);
+      e->value = pmap_copy(e->value, from);
+    }
+  }
+}
+
+// Copies the function, keys and values of a memo moved out of from's heap.
+// Keys hashed by address have moved, so the index is rebuilt.
+void pmap_copy_memo(MEMO *m, INTERP *from)
+{
+  MEMO_ENTRY *e;
+  int64_t i;
+  m->fn = pmap_copy(m->fn, from);
+  for (i = 0; i < m->count; ++i) {
+    e = &m->entries[i];
+    e->key = pmap_copy(e->key, from);
+    e->value = pmap_copy(e->value, from);
+    e->hash = memo_hash(e->key, 0);
+  }
+  memo_reindex(m);
+}
+
+// Copies v, allocated in from's heap, into the current interpreter's heap.
+// Values outside from's heap are returned as they are.  Each copied source
+// cell is overwritten with a forwarding pointer (from's heap is discarded
+// afterwards), so shared structure stays shared and cycles terminate.
+LISP_VALUE *pmap_copy(LISP_VALUE *v, INTERP *from)
+{
+  LISP_VALUE *ret = NULL;
+  LISP_VALUE *tail = NULL;
+  LISP_VALUE *copy;
+  LISP_VALUE *a;
+  LISP_VALUE *e;
+  LISP_VALUE *c;
+  int i;
+  while (NULL != v && IN_HEAP_OF(v, from) && V_CONS_CELL == TYPE_OF(v) &&
+         cell_allocated(v)) {
+    a = v->car;
+    c = v->cdr;
+    copy = new_value(V_CONS_CELL);
+    cell_release(v);
+    v->next_free = copy;
+    if (NULL == ret) {
+      ret = copy;
+    } else {
+      tail->cdr = copy;
+    }
+    tail = copy;
+    copy->car = pmap_copy(a, from);
+    v = c;
+  }
+  if (NULL == v || !IN_HEAP_OF(v, from)) {
+    copy = v;
+  } else if (!cell_allocated(v)) {
+    copy = v->next_free;
+  } else {
+    copy = new_value(TYPE_OF(v));
+    switch (TYPE_OF(v)) {
+      case V_INT:
+        copy->intnum = v->intnum;
+        break;
+      case V_SYMBOL:
+        memcpy(copy->symbol, v->symbol, SYM_SIZE);
+        break;
+      case V_BUILTIN:
+        copy->func_info = v->func_info;
+        break;
+      case V_VECTOR:
+        // The buffer moves to the copy, so it must not be freed with from.
+        copy->vector = v->vector;
+        break;
+      case V_STRING:
+        // So does the reference to the string's buffer.
+        copy->strbuf = v->strbuf;
+        copy->str_start = v->str_start;
+        copy->str_length = v->str_length;
+        break;
+      case V_CLOSURE:
+        a = v->arg_names;
+        e = v->env;
+        c = v->code;
+        cell_release(v);
+        v->next_free = copy;
+        copy->arg_names = copy->env = copy->code = NULL;
+        copy->arg_names = pmap_copy(a, from);
+        copy->env = pmap_copy(e, from);
+        copy->code = pmap_copy(c, from);
+        break;
+      case V_PORT:
+        copy->port = v->port;
+        break;
+      case V_STREAM:
+        a = v->stream_head;
+        c = v->stream_rest;
+        cell_release(v);
+        v->next_free = copy;
+        copy->stream_head = copy->stream_rest = NULL;
+        copy->stream_head = pmap_copy(a, from);
+        copy->stream_rest = pmap_copy(c, from);
+        break;
+      case V_HASHTABLE:
+        // As for channels, the arrays move to the copy with their entries.
+        copy->hashtable = v->hashtable;
+        cell_release(v);
+        v->next_free = copy;
+        pmap_copy_table(copy->hashtable, from);
+        break;
+      case V_MEMO:
+        // So does a memo's cache.
+        copy->memo = v->memo;
+        cell_release(v);
+        v->next_free = copy;
+        pmap_copy_memo(copy->memo, from);
+        break;
+      case V_CHANNEL:
+        // The channel's buffer moves to the copy along with its contents.
+        copy->channel = v->channel;
+        cell_release(v);
+        v->next_free = copy;
+        for (i = 0; i < copy->channel->count; ++i) {
+          e = copy->channel->buffer[i];
+          copy->channel->buffer[i] = pmap_copy(e, from);
+        }
+        break;
+    }
+    if (cell_allocated(v)) {
+      cell_release(v);
+      v->next_free = copy;
+    }
+  }
+  if (NULL == ret) {
+    return copy;
+  }
+  tail->cdr = copy;
+  return ret;
+}
+
+// Single worker: plain map/fold on the calling thread.
+LISP_VALUE *pmap_serial(LISP_VALUE *fn, LISP_VALUE *init, LISP_VALUE *list,
+                        int reduce)
+{
+  LISP_VALUE *head;
+  LISP_VALUE *tail;
+  LISP_VALUE *v;
+  if (reduce) {
+    v = init;
+    FOR_LIST(list, list) {
+      v = pmap_apply2(fn, v, car(list));
+      if (NULL == v) {
+        return NULL;
+      }
+    }
+    return v;
+  }
+  head = new_value(V_CONS_CELL);
+  tail = head;
+  FOR_LIST(list, list) {
+    if (NULL == (v = pmap_apply1(fn, car(list)))) {
+      return NULL;
+    }
+    tail->cdr = cons(v, NULL);
+    tail = tail->cdr;
+  }
+  tail->cdr = create_nil();
+  return head->cdr;
+}
+
+// Copies the workers' results into the caller's heap.
+LISP_VALUE *pmap_gather(PMAP_JOB *job, LISP_VALUE *init)
+{
+  LISP_VALUE *head;
+  LISP_VALUE *tail;
+  LISP_VALUE *v;
+  int i;
+  if (job->reduce) {
+    v = init;
+    for (i = 0; i < job->n_chunks && NULL != v; ++i) {
+      v = pmap_apply2(job->fn, v,
+                      pmap_copy(job->results[i], job->result_heaps[i]));
+    }
+    return v;
+  }
+  head = new_value(V_CONS_CELL);
+  tail = head;
+  for (i = 0; i < job->n_items; ++i) {
+    tail->cdr = cons(NULL, NULL);
+    tail = tail->cdr;
+    tail->car = pmap_copy(job->results[i], job->result_heaps[i]);
+  }
+  tail->cdr = create_nil();
+  return head->cdr;
+}
+
+LISP_VALUE *pmap_run(LISP_VALUE *fn, LISP_VALUE *init, LISP_VALUE *list,
+                     int reduce)
+{
+  PMAP_JOB job;
+  LISP_VALUE *p;
+  LISP_VALUE *ret = NULL;
+  int n_workers = pmap_thread_count();
+  int i;
+  memset(&job, 0, sizeof(job));
+  FOR_LIST(p, list) {
+    job.n_items += 1;
+  }
+  if (n_workers > job.n_items / 2) {
+    n_workers = job.n_items / 2;
+  }
+  if (n_workers <= 1) {
+    return pmap_serial(fn, init, list, reduce);
+  }
+  job.fn = fn;
+  job.reduce = reduce;
+  job.output = interp->output;
+  job.items = malloc(job.n_items*sizeof(LISP_VALUE *));
+  i = 0;
+  FOR_LIST(p, list) {
+    job.items[i++] = car(p);
+  }
+  job.chunk_size = job.n_items / (n_workers*PMAP_CHUNKS_PER_WORKER);
+  if (job.chunk_size < 2) {
+    job.chunk_size = 2;
+  }
+  job.n_chunks = (job.n_items + job.chunk_size - 1) / job.chunk_size;
+  i = reduce ? job.n_chunks : job.n_items;
+  job.results = calloc(i, sizeof(LISP_VALUE *));
+  job.result_heaps = calloc(i, sizeof(INTERP *));
+  job.n_workers = n_workers;
+  job.workers = calloc(n_workers, sizeof(PMAP_WORKER));
+  for (i = 0; i < n_workers; ++i) {
+    job.workers[i].job = &job;
+    job.workers[i].top = i*job.n_chunks / n_workers;
+    job.workers[i].bottom = (i + 1)*job.n_chunks / n_workers;
+    pthread_mutex_init(&job.workers[i].lock, NULL);
+  }
+  for (i = 0; i < n_workers; ++i) {
+    if (0 != pthread_create(&job.workers[i].thread, NULL, pmap_worker,
+                            &job.workers[i])) {
+      fatal("Cannot create thread.");
+    }
+  }
+  for (i = 0; i < n_workers; ++i) {
+    pthread_join(job.workers[i].thread, NULL);
+  }
+  if (!job.failed) {
+    ret = pmap_gather(&job, init);
+  }
+  for (i = 0; i < n_workers; ++i) {
+    pthread_mutex_destroy(&job.workers[i].lock);
+    interp_destroy(job.workers[i].heap);
+  }
+  free(job.workers);
+  free(job.results);
+  free(job.result_heaps);
+  free(job.items);
+  return ret;
+}
+
+LISP_VALUE *fn_pmap(LISP_VALUE *fn, LISP_VALUE *list, LISP_VALUE *env)
+{
+  return pmap_run(fn, NULL, list, 0);
+}
+
+LISP_VALUE *fn_preduce(LISP_VALUE *fn, LISP_VALUE *init, LISP_VALUE *list,
+                       LISP_VALUE *env)
+{
+  return pmap_run(fn, init, list, 1);
+}
+
+void install_pmap_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("pmap", "pmap", fn_pmap, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("preduce", "preduce", fn_preduce, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_CONS_CELL | V_NIL);
+}
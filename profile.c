@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Profiler
+//
+// While interp->profile is set, apply_closure() and call_builtin() bracket
+// every call with prof_enter() and prof_exit(), which read the TSC (the
+// monotonic clock on other hosts) and charge the elapsed ticks to the
+// function and to its node in a calling context tree.  When it is NULL the
+// only cost is that test.  Closures are identified by their code, so every
+// closure made by one (fn ...) form is the same function, and named after
+// the global variable bound to one of them, if any.
+//
+// Recording starts with --profile (for the whole run) or (with-profile
+// expr).  When it stops, a table of calls and inclusive and exclusive times
+// goes to stderr and the tree goes to $ML_PROFILE_OUT (default
+// profile.folded) as collapsed stacks, one "caller;...;callee usecs" line
+// per path, which flamegraph.pl and speedscope read.
+//
+// Only the calling interpreter is profiled: time in pmap workers shows up
+// as time in pmap.  Green threads share the call stack, so calls that span
+// a yield are charged approximately.
+
+// Cheap timestamp.  Only differences are meaningful; they are turned into
+// nanoseconds by comparing against now_ns() over a longer interval.
+uint64_t read_ticks(void)
+{
+#ifdef __x86_64__
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+void prof_fn_name(PROF_FN *f, LISP_VALUE *clo, BUILTIN_INFO *pinfo)
+{
+  LISP_VALUE *e;
+  LISP_VALUE *p;
+  int n;
+  if (NULL != pinfo) {
+    strncpy_with_nul(f->name, '\0' != pinfo->var_name[0] ? pinfo->var_name
+                                                         : pinfo->name,
+                     SYM_SIZE - 1);
+    return;
+  }
+  for (e = interp->global_env; IS_TYPE(e, V_CONS_CELL); e = cdr(cdr(e))) {
+    if (IS_TYPE(car(cdr(e)), V_CLOSURE) && clo->code == car(cdr(e))->code) {
+      strncpy_with_nul(f->name, car(e)->symbol, SYM_SIZE - 1);
+      return;
+    }
+  }
+  // Anonymous: "fn(x y)".
+  n = snprintf(f->name, sizeof(f->name), "fn(");
+  FOR_LIST(p, clo->arg_names) {
+    if (n < (int) sizeof(f->name)) {
+      n += snprintf(f->name + n, sizeof(f->name) - n, "%s%s",
+                    p == clo->arg_names ? "" : " ", car(p)->symbol);
+    }
+  }
+  if (n < (int) sizeof(f->name)) {
+    snprintf(f->name + n, sizeof(f->name) - n, ")");
+  }
+}
+
+// Index of the function with key in p->fns[], adding it if needed.  Slot 0
+// is "(other)", used once the table is 3/4 full.
+int prof_fn_index(PROFILE *p, void *key, LISP_VALUE *clo, BUILTIN_INFO *pinfo)
+{
+  uint64_t i = ((uintptr_t) key >> 4)*0x9e3779b97f4a7c15ull >> 40;
+  for (;; ++i) {
+    i &= PROF_MAX_FNS - 1;
+    if (0 == i) {
+      continue;
+    }
+    if (key == p->fns[i].key) {
+      return i;
+    }
+    if (NULL == p->fns[i].key) {
+      break;
+    }
+  }
+  if (4*p->n_fns >= 3*PROF_MAX_FNS) {
+    return 0;
+  }
+  p->n_fns += 1;
+  p->fns[i].key = key;
+  p->fns[i].clo = clo;
+  prof_fn_name(&p->fns[i], clo, pinfo);
+  return i;
+}
+
+// Node for fn called from parent, adding it if needed.  Once the tree is
+// full, new paths are charged to parent.
+int prof_node_index(PROFILE *p, int parent, int fn)
+{
+  int mask = 2*PROF_MAX_NODES - 1;
+  int i = ((uint32_t) parent*0x9e3779b1u + fn) & mask;
+  int node;
+  while (0 != (node = p->node_index[i])) {
+    if (parent == p->nodes[node - 1].parent && fn == p->nodes[node - 1].fn) {
+      return node - 1;
+    }
+    i = (i + 1) & mask;
+  }
+  if (p->n_nodes == PROF_MAX_NODES) {
+    return parent;
+  }
+  node = p->n_nodes++;
+  p->nodes[node].fn = fn;
+  p->nodes[node].parent = parent;
+  p->nodes[node].excl = 0;
+  p->node_index[i] = node + 1;
+  return node;
+}
+
+void prof_enter(PROFILE *p, void *key, LISP_VALUE *clo, BUILTIN_INFO *pinfo)
+{
+  PROF_FRAME *f;
+  int fn;
+  if (PROF_MAX_DEPTH == p->depth) {
+    p->lost_depth += 1;
+    return;
+  }
+  fn = prof_fn_index(p, key, clo, pinfo);
+  f = &p->stack[p->depth];
+  f->fn = fn;
+  f->node = prof_node_index(p, 0 == p->depth ? 0 : p->stack[p->depth - 1].node,
+                            fn);
+  f->child = 0;
+  p->depth += 1;
+  p->fns[fn].calls += 1;
+  p->fns[fn].active += 1;
+  // Last, so the bookkeeping above is charged to the caller.
+  f->start = read_ticks();
+}
+
+void prof_exit(PROFILE *p)
+{
+  uint64_t now = read_ticks();
+  uint64_t elapsed;
+  PROF_FRAME *f;
+  PROF_FN *fn;
+  if (p->lost_depth > 0) {
+    p->lost_depth -= 1;
+    return;
+  }
+  if (0 == p->depth) {
+    return;
+  }
+  f = &p->stack[--p->depth];
+  fn = &p->fns[f->fn];
+  elapsed = now - f->start;
+  fn->excl += elapsed - f->child;
+  p->nodes[f->node].excl += elapsed - f->child;
+  // Only the outermost of nested recursive calls counts towards incl.
+  if (0 == --fn->active) {
+    fn->incl += elapsed;
+  }
+  if (p->depth > 0) {
+    p->stack[p->depth - 1].child += elapsed;
+  }
+}
+
+// Starts recording.  Returns 0 if out of memory.
+int prof_start(void)
+{
+  PROFILE *p;
+  if (NULL == (p = interp->profile_mem) &&
+      NULL == (p = interp->profile_mem = malloc(sizeof(PROFILE)))) {
+    error("Cannot allocate profile.");
+    return 0;
+  }
+  memset(p, 0, sizeof(PROFILE));
+  strcpy(p->fns[0].name, "(other)");
+  // The root node.
+  p->nodes[0].fn = 0;
+  p->nodes[0].parent = -1;
+  p->n_nodes = 1;
+  p->start_ns = now_ns();
+  p->start_ticks = read_ticks();
+  interp->profile = p;
+  return 1;
+}
+
+void prof_report(PROFILE *p, FILE *out, double ns_per_tick, uint64_t total_ns)
+{
+  int order[PROF_MAX_FNS];
+  int n = 0;
+  int i;
+  int j;
+  uint64_t calls = 0;
+  for (i = 0; i < PROF_MAX_FNS; ++i) {
+    if (p->fns[i].calls > 0) {
+      calls += p->fns[i].calls;
+      // Insertion sort by exclusive time, largest first.
+      for (j = n++; j > 0 && p->fns[order[j - 1]].excl < p->fns[i].excl; --j) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+  }
+  fprintf(out, "Profile: %.3f ms, %llu calls\n", total_ns/1e6,
+          (unsigned long long) calls);
+  fprintf(out, "%12s %12s %12s  %s\n", "calls", "incl ms", "excl ms",
+          "function");
+  for (i = 0; i < n; ++i) {
+    fprintf(out, "%12llu %12.3f %12.3f  %s\n",
+            (unsigned long long) p->fns[order[i]].calls,
+            p->fns[order[i]].incl*ns_per_tick/1e6,
+            p->fns[order[i]].excl*ns_per_tick/1e6, p->fns[order[i]].name);
+  }
+}
+
+// Writes one line per node of the tree: the names on its path from the root
+// and its exclusive time in microseconds.
+int prof_write_folded(PROFILE *p, char *path, double ns_per_tick)
+{
+  int stack[PROF_MAX_DEPTH];
+  FILE *f;
+  uint64_t usecs;
+  int depth;
+  int node;
+  int i;
+  if (NULL == (f = fopen(path, "w"))) {
+    perror(path);
+    return 0;
+  }
+  for (i = 1; i < p->n_nodes; ++i) {
+    if (0 == (usecs = p->nodes[i].excl*ns_per_tick/1000)) {
+      continue;
+    }
+    depth = 0;
+    for (node = i; node > 0 && depth < PROF_MAX_DEPTH;
+         node = p->nodes[node].parent) {
+      stack[depth++] = p->nodes[node].fn;
+    }
+    while (depth-- > 0) {
+      fprintf(f, "%s%c", p->fns[stack[depth]].name, depth > 0 ? ';' : ' ');
+    }
+    fprintf(f, "%llu\n", (unsigned long long) usecs);
+  }
+  fclose(f);
+  return 1;
+}
+
+// Stops recording and writes the report and collapsed stacks.  The PROFILE
+// is kept for the next recording: a green thread may still return from a
+// call it entered while recording.
+void prof_stop(void)
+{
+  PROFILE *p = interp->profile;
+  uint64_t total_ns = now_ns() - p->start_ns;
+  uint64_t ticks = read_ticks() - p->start_ticks;
+  double ns_per_tick = 0 == ticks ? 0 : (double) total_ns/ticks;
+  char *path = getenv("ML_PROFILE_OUT");
+  interp->profile = NULL;
+  prof_report(p, stderr, ns_per_tick, total_ns);
+  if (NULL == path) {
+    path = "profile.folded";
+  }
+  if (prof_write_folded(p, path, ns_per_tick)) {
+    fprintf(stderr, "Collapsed stacks written to %s\n", path);
+  }
+}
+
+// Keeps the closures identifying functions alive while recording.
+void prof_gc_walk(void)
+{
+  int i;
+  if (NULL != interp->profile) {
+    for (i = 1; i < PROF_MAX_FNS; ++i) {
+      if (NULL != interp->profile->fns[i].clo) {
+        gc_walk(interp->profile->fns[i].clo, 0);
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Profiler built-ins
+
+// (with-profile expr): evaluates expr while recording a profile.  Inside
+// another recording it only evaluates expr.
+LISP_VALUE *fn_with_profile(LISP_VALUE *expr, LISP_VALUE *env)
+{
+  LISP_VALUE *ret;
+  if (NULL != interp->profile) {
+    return eval(expr, env);
+  }
+  if (!prof_start()) {
+    return NULL;
+  }
+  ret = eval(expr, env);
+  prof_stop();
+  return ret;
+}
+
+void install_profile_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("with-profile", "with-profile", fn_with_profile, 1);
+  set_builtin_arg_info(idx, 0, ARG_UNEVALED, V_ANY);
+}
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Evaluation server
+//
+// "ml [file ...] --serve SOCKET" loads the files into a master interpreter,
+// then forks --workers copies of it which wait on a Unix domain socket.
+// Each worker starts out with the master's heap, builtins and global
+// environment (shared copy-on-write), so a request pays for none of the
+// start up work.
+//
+// A request is a connection: the client writes forms and shuts down its
+// side, the worker evaluates them and streams back exactly what the REPL
+// would print (errors included), then closes the connection and exits.
+// The master forks a fresh worker from its untouched image to replace it,
+// so no request ever sees state left behind by another.
+//
+// "ml --client SOCKET [file ...]" sends the files, or stdin, as one request
+// and copies the response to stdout.
+
+// Seconds between attempts to replace a worker fork() could not start.
+#define SERVER_FORK_RETRY 1
+
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int sig)
+{
+  server_stopping = 1;
+}
+
+int server_listen(char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    error("Socket path too long.");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 128) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int server_connect(char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    error("Socket path too long.");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Reads from fd until end of file into a malloc()ed buffer.  NULL if out
+// of memory.
+char *read_fd(int fd, long *len)
+{
+  long size = 4096;
+  char *buf = malloc(size);
+  char *grown;
+  ssize_t n;
+  *len = 0;
+  while (NULL != buf) {
+    if (*len == size) {
+      size *= 2;
+      if (NULL == (grown = realloc(buf, size))) {
+        free(buf);
+        return NULL;
+      }
+      buf = grown;
+      continue;
+    }
+    n = read(fd, buf + *len, size - *len);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    *len += n;
+  }
+  return buf;
+}
+
+int write_all(int fd, char *buf, long len)
+{
+  ssize_t n;
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+void server_handle(int conn)
+{
+  char *buf;
+  long len;
+  LISP_VALUE *forms;
+  FILE *out;
+  if (NULL == (buf = read_fd(conn, &len)) ||
+      NULL == (out = fdopen(conn, "w"))) {
+    close(conn);
+    return;
+  }
+  // Error messages go to the client along with the results.
+  dup2(conn, 2);
+  interp->output = out;
+  if (NULL == (forms = read_forms(buf, len))) {
+    fprintf(out, "ERROR: failed to read request\n");
+  } else {
+    eval_forms(forms);
+  }
+  free(buf);
+  fclose(out);
+}
+
+pid_t server_fork_worker(int listen_fd)
+{
+  pid_t pid = fork();
+  int conn;
+  if (0 == pid) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    do {
+      conn = accept(listen_fd, NULL, NULL);
+    } while (conn < 0 && EINTR == errno);
+    close(listen_fd);
+    if (conn >= 0) {
+      server_handle(conn);
+    }
+    // Skip exit handlers and stdio buffers inherited from the master.
+    _exit(0);
+  }
+  return pid;
+}
+
+// Forks a worker into every empty (0) slot of workers.  Returns how many
+// slots are still empty because fork() failed.
+int server_fill_workers(pid_t *workers, int n_workers, int listen_fd)
+{
+  int n_missing = 0;
+  int i;
+  for (i = 0; i < n_workers; ++i) {
+    if (0 == workers[i] && (workers[i] = server_fork_worker(listen_fd)) < 0) {
+      perror("fork");
+      workers[i] = 0;
+      n_missing += 1;
+    }
+  }
+  return n_missing;
+}
+
+int run_server(char *path, int n_workers)
+{
+  struct sigaction sa;
+  pid_t *workers;
+  pid_t pid;
+  int listen_fd;
+  int n_missing;
+  int status;
+  int i;
+  if ((listen_fd = server_listen(path)) < 0) {
+    return 1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = server_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  fflush(stdout);
+  fflush(stderr);
+  if (NULL == (workers = calloc(n_workers, sizeof(pid_t)))) {
+    fprintf(stderr, "Cannot allocate workers.\n");
+    close(listen_fd);
+    unlink(path);
+    return 1;
+  }
+  n_missing = server_fill_workers(workers, n_workers, listen_fd);
+  fprintf(stderr, "Serving on %s with %d workers.\n", path,
+          n_workers - n_missing);
+  while (!server_stopping) {
+    // While a fork() has failed, retry every SERVER_FORK_RETRY seconds
+    // instead of waiting for a worker to exit.
+    pid = waitpid(-1, &status, n_missing > 0 ? WNOHANG : 0);
+    if (pid < 0 && EINTR == errno) {
+      continue;
+    }
+    if (pid < 0 && (ECHILD != errno || 0 == n_missing)) {
+      break;
+    }
+    if (pid <= 0) {
+      sleep(SERVER_FORK_RETRY);
+    }
+    for (i = 0; i < n_workers; ++i) {
+      if (pid > 0 && workers[i] == pid) {
+        workers[i] = 0;
+      }
+    }
+    n_missing = server_fill_workers(workers, n_workers, listen_fd);
+  }
+  for (i = 0; i < n_workers; ++i) {
+    if (workers[i] > 0) {
+      kill(workers[i], SIGTERM);
+    }
+  }
+  while (waitpid(-1, &status, 0) > 0 || EINTR == errno) {
+  }
+  close(listen_fd);
+  unlink(path);
+  free(workers);
+  return 0;
+}
+
+int run_client(char *path, char **files, int n_files)
+{
+  char *buf;
+  long len;
+  int fd;
+  int i;
+  if ((fd = server_connect(path)) < 0) {
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (0 == n_files) {
+    if (NULL == (buf = read_fd(0, &len))) {
+      fprintf(stderr, "Cannot read the request.\n");
+      close(fd);
+      return 1;
+    }
+    write_all(fd, buf, len);
+    free(buf);
+  }
+  for (i = 0; i < n_files; ++i) {
+    if (NULL == (buf = read_file(files[i], &len))) {
+      close(fd);
+      return 1;
+    }
+    write_all(fd, buf, len);
+    // Keep the last form of one file from running into the next.
+    write_all(fd, "\n", 1);
+    free(buf);
+  }
+  shutdown(fd, SHUT_WR);
+  if (NULL == (buf = read_fd(fd, &len))) {
+    fprintf(stderr, "Cannot read the response.\n");
+    close(fd);
+    return 1;
+  }
+  fwrite(buf, 1, len, stdout);
+  free(buf);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Streams
+//
+// A stream is nil or a V_STREAM cell holding its first element and a
+// delayed rest.  The rest is only computed when something asks for it, and
+// is then stored in the cell in place of the delay, so each element is
+// computed once.  A delay is a list (how . args): either a function called
+// with no arguments that returns the rest, as made by (stream-cons x fn),
+// or a STREAM_* code for the streams built in here.
+//
+// Nothing keeps a stream's elements alive except references to its cells,
+// so a pipeline over a file of any size runs in bounded heap as long as
+// nothing holds on to the head.  stream-fold and stream->list evaluate their
+// stream argument themselves for that reason: an argument evaluated by
+// eval_builtin() would stay on the C stack, and the stack is a GC root.
+// Binding a long stream to a global variable keeps all of it.
+
+enum {
+  STREAM_LINES,
+  STREAM_FORMS,
+  STREAM_MAP,
+  STREAM_FILTER,
+  STREAM_TAKE
+};
+
+LISP_VALUE *stream_cons(LISP_VALUE *head, LISP_VALUE *delay)
+{
+  LISP_VALUE *ret = new_value(V_STREAM);
+  ret->stream_head = head;
+  ret->stream_rest = delay;
+  return ret;
+}
+
+// Returns the list (how a b), or (how a) if b is NULL.
+LISP_VALUE *stream_delay(int how, LISP_VALUE *a, LISP_VALUE *b)
+{
+  LISP_VALUE *args = cons(a, create_nil());
+  if (NULL != b) {
+    args->cdr = cons(b, args->cdr);
+  }
+  return cons(create_intnum(how), args);
+}
+
+// Reads the next line of port as a string, without its newline.  Returns
+// nil at end of file.
+LISP_VALUE *port_read_line(LISP_VALUE *port)
+{
+  FILE *f = port->port->file;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  STRBUF *buf;
+  if (NULL == f || (len = getline(&line, &size, f)) < 0) {
+    free(line);
+    port_close(port->port);
+    return create_nil();
+  }
+  if (len > 0 && '\n' == line[len - 1]) {
+    len -= 1;
+  }
+  if (NULL == (buf = strbuf_alloc(len))) {
+    free(line);
+    error("Cannot allocate string.");
+    return NULL;
+  }
+  memcpy(buf->data, line, len);
+  buf->used = len;
+  free(line);
+  return create_string(buf, 0, len);
+}
+
+// Reads the next form of port with the reader.  Sets *end at end of file.
+LISP_VALUE *port_read_form(LISP_VALUE *port, int *end)
+{
+  FILE *saved_stream = interp->input_stream;
+  int saved_char = interp->current_char;
+  int saved_prompt = interp->show_prompt;
+  int saved_level = interp->nest_level;
+  LISP_VALUE *form = NULL;
+  *end = 1;
+  if (NULL != port->port->file) {
+    interp->input_stream = port->port->file;
+    interp->current_char = port->port->current_char;
+    interp->show_prompt = 0;
+    interp->nest_level = 0;
+    skip_blanks();
+    if (EOF != interp->current_char) {
+      *end = 0;
+      form = read_lisp_value();
+    }
+    port->port->current_char = interp->current_char;
+    interp->input_stream = saved_stream;
+    interp->current_char = saved_char;
+    interp->show_prompt = saved_prompt;
+    interp->nest_level = saved_level;
+  }
+  if (*end) {
+    port_close(port->port);
+  }
+  return form;
+}
+
+void port_close(PORT *p)
+{
+  if (NULL != p->file) {
+    fclose(p->file);
+    p->file = NULL;
+  }
+}
+
+// Returns the stream of the lines or forms of a file.
+LISP_VALUE *stream_open(LISP_VALUE *path, int how)
+{
+  char name[4096];
+  FILE *f;
+  PORT *p;
+  LISP_VALUE *port;
+  LISP_VALUE *delay;
+  if (!string_to_cstr(path, name, sizeof(name))) {
+    error("File name too long.");
+    return NULL;
+  }
+  if (NULL == (f = fopen(name, "r"))) {
+    flush_output();
+    perror(name);
+    return NULL;
+  }
+  if (NULL == (p = malloc(sizeof(PORT)))) {
+    fclose(f);
+    error("Cannot allocate port.");
+    return NULL;
+  }
+  p->file = f;
+  p->current_char = ' ';
+  port = new_value(V_PORT);
+  port->port = p;
+  // Every cell of the stream computes its rest the same way, so they all
+  // share one delay.
+  delay = stream_delay(how, port, NULL);
+  return stream_force_delay(delay);
+}
+
+// Skips elements of s for which pred returns nil.  Returns the first stream
+// cell whose head satisfies pred, or nil.
+LISP_VALUE *stream_skip(LISP_VALUE *pred, LISP_VALUE *s)
+{
+  LISP_VALUE *keep;
+  while (IS_TYPE(s, V_STREAM)) {
+    if (NULL == (keep = apply_fn_1(pred, s->stream_head))) {
+      return NULL;
+    }
+    if (!IS_TYPE(keep, V_NIL)) {
+      break;
+    }
+    s = stream_rest(s);
+  }
+  return s;
+}
+
+// Computes the stream a delay stands for.
+LISP_VALUE *stream_force_delay(LISP_VALUE *delay)
+{
+  LISP_VALUE *how = car(delay);
+  LISP_VALUE *args = cdr(delay);
+  LISP_VALUE *fn;
+  LISP_VALUE *s;
+  LISP_VALUE *v;
+  int end;
+  if (!IS_TYPE(how, V_INT)) {
+    return apply_fn(how, args);
+  }
+  switch (how->intnum) {
+    case STREAM_LINES:
+      v = port_read_line(car(args));
+      return IS_TYPE(v, V_STRING) ? stream_cons(v, delay) : v;
+    case STREAM_FORMS:
+      v = port_read_form(car(args), &end);
+      return NULL == v ? (end ? create_nil() : NULL) : stream_cons(v, delay);
+    case STREAM_MAP:
+      fn = car(args);
+      if (NULL == (s = stream_rest(cadr(args))) || !IS_TYPE(s, V_STREAM)) {
+        return s;
+      }
+      if (NULL == (v = apply_fn_1(fn, s->stream_head))) {
+        return NULL;
+      }
+      return stream_cons(v, stream_delay(STREAM_MAP, fn, s));
+    case STREAM_FILTER:
+      fn = car(args);
+      s = stream_skip(fn, stream_rest(cadr(args)));
+      if (!IS_TYPE(s, V_STREAM)) {
+        return s;
+      }
+      return stream_cons(s->stream_head, stream_delay(STREAM_FILTER, fn, s));
+    case STREAM_TAKE:
+      // (n s): s has been taken, n more elements are wanted after it.
+      if (car(args)->intnum <= 0) {
+        return create_nil();
+      }
+      if (NULL == (s = stream_rest(cadr(args))) || !IS_TYPE(s, V_STREAM)) {
+        return s;
+      }
+      return stream_cons(s->stream_head,
+                         stream_delay(STREAM_TAKE,
+                                      create_intnum(car(args)->intnum - 1), s));
+  }
+  fatal("Unknown stream delay.");
+  return NULL;
+}
+
+// Returns the rest of the stream s, computing it the first time.  NULL if
+// computing it failed; the delay is kept so a later call tries again.
+// A pmap worker can follow a stream of the caller's heap only as far as it
+// has been computed: caching the rest would leave the caller's cell
+// pointing into the worker's heap, and the workers would race reading the
+// stream's file.
+LISP_VALUE *stream_rest(LISP_VALUE *s)
+{
+  LISP_VALUE *rest;
+  if (!IS_TYPE(s->stream_rest, V_CONS_CELL)) {
+    return s->stream_rest;
+  }
+  if (!IN_HEAP(s)) {
+    error("Cannot force a stream from another heap.");
+    return NULL;
+  }
+  if (NULL == (rest = stream_force_delay(s->stream_rest))) {
+    return NULL;
+  }
+  if (!IS_TYPE(rest, V_STREAM | V_NIL)) {
+    error("Stream delay did not return a stream or nil.");
+    return NULL;
+  }
+  s->stream_rest = rest;
+  return rest;
+}
+
+//------------------------------------------------------------------------------
+/// Stream built-ins
+
+LISP_VALUE *fn_stream_cons(LISP_VALUE *head, LISP_VALUE *fn, LISP_VALUE *env)
+{
+  return stream_cons(head, cons(fn, create_nil()));
+}
+
+LISP_VALUE *fn_stream_first(LISP_VALUE *s, LISP_VALUE *env)
+{
+  return s->stream_head;
+}
+
+LISP_VALUE *fn_stream_rest(LISP_VALUE *s, LISP_VALUE *env)
+{
+  return stream_rest(s);
+}
+
+LISP_VALUE *fn_file_lines(LISP_VALUE *path, LISP_VALUE *env)
+{
+  return stream_open(path, STREAM_LINES);
+}
+
+LISP_VALUE *fn_file_forms(LISP_VALUE *path, LISP_VALUE *env)
+{
+  return stream_open(path, STREAM_FORMS);
+}
+
+LISP_VALUE *fn_stream_map(LISP_VALUE *fn, LISP_VALUE *s, LISP_VALUE *env)
+{
+  LISP_VALUE *v;
+  if (!IS_TYPE(s, V_STREAM)) {
+    return s;
+  }
+  if (NULL == (v = apply_fn_1(fn, s->stream_head))) {
+    return NULL;
+  }
+  return stream_cons(v, stream_delay(STREAM_MAP, fn, s));
+}
+
+LISP_VALUE *fn_stream_filter(LISP_VALUE *fn, LISP_VALUE *s, LISP_VALUE *env)
+{
+  s = stream_skip(fn, s);
+  if (!IS_TYPE(s, V_STREAM)) {
+    return s;
+  }
+  return stream_cons(s->stream_head, stream_delay(STREAM_FILTER, fn, s));
+}
+
+LISP_VALUE *fn_stream_take(LISP_VALUE *n, LISP_VALUE *s, LISP_VALUE *env)
+{
+  if (n->intnum <= 0 || !IS_TYPE(s, V_STREAM)) {
+    return create_nil();
+  }
+  return stream_cons(s->stream_head,
+                     stream_delay(STREAM_TAKE, create_intnum(n->intnum - 1), s));
+}
+
+// Evaluates the stream argument of a consuming builtin.
+LISP_VALUE *stream_eval_arg(char *fn_name, LISP_VALUE *expr, LISP_VALUE *env)
+{
+  LISP_VALUE *s = eval(expr, env);
+  if (NULL != s && !IS_TYPE(s, V_STREAM | V_NIL)) {
+    arg_type_error(fn_name, 2, s, V_STREAM | V_NIL);
+    return NULL;
+  }
+  return s;
+}
+
+// (stream-fold fn init s): (fn (fn init x1) x2) ...
+LISP_VALUE *fn_stream_fold(LISP_VALUE *fn, LISP_VALUE *acc, LISP_VALUE *expr,
+                           LISP_VALUE *env)
+{
+  LISP_VALUE *s = stream_eval_arg("stream-fold", expr, env);
+  while (NULL != acc && IS_TYPE(s, V_STREAM)) {
+    acc = apply_fn(fn, cons(acc, cons(s->stream_head, create_nil())));
+    s = stream_rest(s);
+  }
+  return NULL == s ? NULL : acc;
+}
+
+LISP_VALUE *fn_stream_to_list(LISP_VALUE *expr, LISP_VALUE *env)
+{
+  LISP_VALUE *s = stream_eval_arg("stream->list", expr, env);
+  LISP_VALUE *head = new_value(V_CONS_CELL);
+  LISP_VALUE *tail = head;
+  while (IS_TYPE(s, V_STREAM)) {
+    tail->cdr = cons(s->stream_head, NULL);
+    tail = tail->cdr;
+    s = stream_rest(s);
+  }
+  if (NULL == s) {
+    return NULL;
+  }
+  tail->cdr = create_nil();
+  return head->cdr;
+}
+
+void install_stream_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("stream-cons", "stream-cons", fn_stream_cons, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_ANY);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_CALLABLE);
+  idx = install_builtin_fn("stream-first", "stream-first", fn_stream_first, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STREAM);
+  idx = install_builtin_fn("stream-rest", "stream-rest", fn_stream_rest, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STREAM);
+  idx = install_builtin_fn("file-lines", "file-lines", fn_file_lines, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  idx = install_builtin_fn("file-forms", "file-forms", fn_file_forms, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  idx = install_builtin_fn("stream-map", "stream-map", fn_stream_map, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_STREAM | V_NIL);
+  idx = install_builtin_fn("stream-filter", "stream-filter", fn_stream_filter, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_STREAM | V_NIL);
+  idx = install_builtin_fn("stream-take", "stream-take", fn_stream_take, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_STREAM | V_NIL);
+  idx = install_builtin_fn("stream-fold", "stream-fold", fn_stream_fold, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  set_builtin_arg_info(idx, 2, ARG_UNEVALED, V_ANY);
+  idx = install_builtin_fn("stream->list", "stream->list", fn_stream_to_list, 1);
+  set_builtin_arg_info(idx, 0, ARG_UNEVALED, V_ANY);
+}
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Strings
+//
+// A string cell is a view: a STRBUF and the offset and length of the bytes it
+// covers.  The bytes live outside the heap, so a string of any length costs
+// one cell, and substring only makes a new view of the same buffer.  Buffers
+// are reference counted by the cells viewing them (atomically, since pmap
+// workers make views of the caller's strings) and freed by the finalizer of
+// the last one.
+//
+// A buffer doubles as a string builder.  Bytes already handed out are never
+// changed, but the space after `used' is free: appending to a string that
+// ends exactly at `used' writes into that space and returns a longer view of
+// the same buffer.  A loop that keeps appending to its latest result copies
+// each byte O(1) times, and views made earlier are unaffected.
+
+STRBUF *strbuf_alloc(int64_t capacity)
+{
+  STRBUF *buf;
+  if (capacity < 0 || capacity > INT64_MAX/2 ||
+      NULL == (buf = malloc(sizeof(STRBUF) + capacity))) {
+    return NULL;
+  }
+  buf->refs = 0;
+  buf->used = 0;
+  buf->capacity = capacity;
+  return buf;
+}
+
+void strbuf_retain(STRBUF *buf)
+{
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void strbuf_release(STRBUF *buf)
+{
+  if (NULL != buf && 0 == __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL)) {
+    free(buf);
+  }
+}
+
+// Returns a new string cell viewing length bytes of buf at start.
+LISP_VALUE *create_string(STRBUF *buf, int64_t start, int64_t length)
+{
+  LISP_VALUE *ret = new_value(V_STRING);
+  strbuf_retain(buf);
+  ret->strbuf = buf;
+  ret->str_start = start;
+  ret->str_length = length;
+  return ret;
+}
+
+// Returns a new string holding a copy of n bytes, with room to append as
+// many again.
+LISP_VALUE *create_string_bytes(char *bytes, int64_t n)
+{
+  STRBUF *buf = strbuf_alloc(2*n > 16 ? 2*n : 16);
+  if (NULL == buf) {
+    error("Cannot allocate string.");
+    return NULL;
+  }
+  memcpy(buf->data, bytes, n);
+  buf->used = n;
+  return create_string(buf, 0, n);
+}
+
+char *string_data(LISP_VALUE *s)
+{
+  return s->strbuf->data + s->str_start;
+}
+
+// Copies s into dest as a C string.  Returns 0 if it does not fit in size
+// bytes.
+int string_to_cstr(LISP_VALUE *s, char *dest, int64_t size)
+{
+  if (s->str_length >= size) {
+    return 0;
+  }
+  memcpy(dest, string_data(s), s->str_length);
+  dest[s->str_length] = '\0';
+  return 1;
+}
+
+// Returns s with n bytes appended.
+LISP_VALUE *string_append(LISP_VALUE *s, char *bytes, int64_t n)
+{
+  STRBUF *buf = s->strbuf;
+  STRBUF *grown;
+  int64_t end = s->str_start + s->str_length;
+  int64_t used = end;
+  int64_t length = s->str_length + n;
+  if (n <= buf->capacity - end &&
+      __atomic_compare_exchange_n(&buf->used, &used, end + n, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    memcpy(buf->data + end, bytes, n);
+    return create_string(buf, s->str_start, length);
+  }
+  // Someone else owns the space after s: start a new buffer.
+  if (NULL == (grown = strbuf_alloc(2*length > 16 ? 2*length : 16))) {
+    error("Cannot allocate string.");
+    return NULL;
+  }
+  memcpy(grown->data, string_data(s), s->str_length);
+  memcpy(grown->data + s->str_length, bytes, n);
+  grown->used = length;
+  return create_string(grown, 0, length);
+}
+
+// Reads the rest of a string literal; the opening quote has been skipped.
+LISP_VALUE *read_string(void)
+{
+  STRBUF *buf = strbuf_alloc(64);
+  STRBUF *grown;
+  int c;
+  while (NULL != buf && '"' != (c = interp->current_char)) {
+    if (EOF == c) {
+      free(buf);
+      error("Unexpected end of input in string.");
+      return NULL;
+    }
+    if ('\\' == c) {
+      next_char();
+      switch (c = interp->current_char) {
+        case 'n':
+          c = '\n';
+          break;
+        case 't':
+          c = '\t';
+          break;
+        case EOF:
+          continue;
+      }
+    }
+    if (buf->used == buf->capacity) {
+      grown = realloc(buf, sizeof(STRBUF) + 2*buf->capacity);
+      if (NULL == grown) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = grown;
+      buf->capacity *= 2;
+    }
+    buf->data[buf->used++] = c;
+    next_char();
+  }
+  if (NULL == buf) {
+    error("Cannot allocate string.");
+    return NULL;
+  }
+  next_char();  // skip '"'
+  return create_string(buf, 0, buf->used);
+}
+
+void print_string(LISP_VALUE *s)
+{
+  char *p = string_data(s);
+  int64_t i;
+  fputc('"', interp->output);
+  for (i = 0; i < s->str_length; ++i) {
+    switch (p[i]) {
+      case '\n':
+        fputs("\\n", interp->output);
+        break;
+      case '\t':
+        fputs("\\t", interp->output);
+        break;
+      case '"':
+      case '\\':
+        fputc('\\', interp->output);
+        // fall through
+      default:
+        fputc(p[i], interp->output);
+        break;
+    }
+  }
+  fputc('"', interp->output);
+}
+
+//------------------------------------------------------------------------------
+/// String built-ins
+
+LISP_VALUE *fn_string_length(LISP_VALUE *s, LISP_VALUE *env)
+{
+  return create_intnum(s->str_length);
+}
+
+LISP_VALUE *fn_substring(LISP_VALUE *s, LISP_VALUE *start, LISP_VALUE *end,
+                         LISP_VALUE *env)
+{
+  if (start->intnum < 0 || start->intnum > end->intnum ||
+      end->intnum > s->str_length) {
+    error("Substring out of range.");
+    return NULL;
+  }
+  return create_string(s->strbuf, s->str_start + start->intnum,
+                       end->intnum - start->intnum);
+}
+
+// Offset of the first occurrence of pattern in s, or nil.
+LISP_VALUE *fn_string_search(LISP_VALUE *s, LISP_VALUE *pattern,
+                             LISP_VALUE *env)
+{
+  char *found = memmem(string_data(s), s->str_length, string_data(pattern),
+                       pattern->str_length);
+  if (NULL == found) {
+    return create_nil();
+  }
+  return create_intnum(found - string_data(s));
+}
+
+// (string-append s x): x is a string, a symbol or an integer, appended as
+// it would print.
+LISP_VALUE *fn_string_append(LISP_VALUE *s, LISP_VALUE *x, LISP_VALUE *env)
+{
+  char digits[24];
+  if (IS_TYPE(x, V_STRING)) {
+    return string_append(s, string_data(x), x->str_length);
+  } else if (IS_TYPE(x, V_SYMBOL)) {
+    return string_append(s, x->symbol, strlen(x->symbol));
+  }
+  return string_append(s, digits, sprintf(digits, "%lld",
+                                          (long long) x->intnum));
+}
+
+LISP_VALUE *fn_string_to_symbol(LISP_VALUE *s, LISP_VALUE *env)
+{
+  char name[SYM_SIZE];
+  if (s->str_length >= SYM_SIZE || 0 == s->str_length) {
+    error("string->symbol: symbols have 1 to 15 characters.");
+    return NULL;
+  }
+  memcpy(name, string_data(s), s->str_length);
+  name[s->str_length] = '\0';
+  return create_symbol(name);
+}
+
+LISP_VALUE *fn_symbol_to_string(LISP_VALUE *sym, LISP_VALUE *env)
+{
+  return create_string_bytes(sym->symbol, strlen(sym->symbol));
+}
+
+void install_string_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("string-length", "string-length", fn_string_length, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  idx = install_builtin_fn("substring", "substring", fn_substring, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("string-search", "string-search", fn_string_search, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_STRING);
+  idx = install_builtin_fn("string-append", "string-append", fn_string_append, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_STRING | V_SYMBOL | V_INT);
+  idx = install_builtin_fn("string->symbol", "string->symbol",
+                           fn_string_to_symbol, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  idx = install_builtin_fn("symbol->string", "symbol->string",
+                           fn_symbol_to_string, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_SYMBOL);
+}
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Hash tables
+//
+// A hash table is a cell pointing at a malloc()ed HASHTABLE: one flat array
+// of (key, value, hash) slots probed linearly, so a lookup usually touches a
+// single cache line.  Keys are integers (compared by value) and symbols
+// (compared by name, as sym_eq() does).  Deleting shifts the rest of the
+// probe sequence back instead of leaving tombstones.
+//
+// A table grows when it is 3/4 full.  Instead of rehashing every entry at
+// once, growing allocates an array twice the size and keeps the old one;
+// each later operation moves the next TABLE_MIGRATE_STEP slots of the old
+// array across.  Until the old array is empty, lookups try the new array
+// and then the old one.  Entries leaving the old array are replaced with
+// TABLE_TOMBSTONE so the probe sequences of those still in it stay intact.
+
+uint64_t table_hash(LISP_VALUE *key)
+{
+  uint64_t h;
+  int i;
+  if (IS_TYPE(key, V_INT)) {
+    h = (uint64_t) key->intnum*0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+  }
+  // FNV-1a over the name.
+  h = 0xcbf29ce484222325ull;
+  for (i = 0; i < SYM_SIZE && '\0' != key->symbol[i]; ++i) {
+    h = (h ^ (unsigned char) key->symbol[i])*0x100000001b3ull;
+  }
+  return h;
+}
+
+int table_key_eq(LISP_VALUE *x, LISP_VALUE *y)
+{
+  if (TYPE_OF(x) != TYPE_OF(y)) {
+    return 0;
+  }
+  return IS_TYPE(x, V_INT) ? x->intnum == y->intnum : sym_eq(x, y);
+}
+
+// Index of the slot holding key, or of the empty slot that ends its probe
+// sequence.
+int64_t table_probe(TABLE_ENTRY *entries, int64_t capacity, LISP_VALUE *key,
+                    uint64_t hash)
+{
+  int64_t mask = capacity - 1;
+  int64_t i = hash & mask;
+  while (NULL != entries[i].key) {
+    if (TABLE_TOMBSTONE != entries[i].key && hash == entries[i].hash &&
+        table_key_eq(entries[i].key, key)) {
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Empties slot i of an array without tombstones, moving back any entry
+// further along the probe sequence that may fill the hole.
+void table_remove_slot(TABLE_ENTRY *entries, int64_t capacity, int64_t i)
+{
+  int64_t mask = capacity - 1;
+  int64_t j = i;
+  int64_t home;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (NULL == entries[j].key) {
+      break;
+    }
+    // Entry j can move to i unless its home slot lies in (i, j].
+    home = entries[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      entries[i] = entries[j];
+      i = j;
+    }
+  }
+  entries[i].key = NULL;
+  entries[i].value = NULL;
+}
+
+// Moves up to n_slots slots of the old array into the new one.
+void table_migrate(HASHTABLE *t, int64_t n_slots)
+{
+  TABLE_ENTRY *e;
+  int64_t i;
+  while (NULL != t->old_entries && n_slots-- > 0) {
+    e = &t->old_entries[t->migrate_pos];
+    if (NULL != e->key && TABLE_TOMBSTONE != e->key) {
+      i = table_probe(t->entries, t->capacity, e->key, e->hash);
+      t->entries[i] = *e;
+      e->key = TABLE_TOMBSTONE;
+      e->value = NULL;
+    }
+    if (++t->migrate_pos == t->old_capacity) {
+      free(t->old_entries);
+      t->old_entries = NULL;
+      t->old_capacity = 0;
+    }
+  }
+}
+
+int table_grow(HASHTABLE *t)
+{
+  TABLE_ENTRY *entries;
+  // Finish the previous growth first.  The steps taken by each operation
+  // normally get there long before the new array fills up.
+  table_migrate(t, t->old_capacity);
+  if (NULL == (entries = calloc(2*t->capacity, sizeof(TABLE_ENTRY)))) {
+    error("Cannot grow hash table.");
+    return 0;
+  }
+  t->old_entries = t->entries;
+  t->old_capacity = t->capacity;
+  t->migrate_pos = 0;
+  t->entries = entries;
+  t->capacity *= 2;
+  return 1;
+}
+
+// Slot holding key in either array, or NULL.
+TABLE_ENTRY *table_find(HASHTABLE *t, LISP_VALUE *key, uint64_t hash)
+{
+  int64_t i = table_probe(t->entries, t->capacity, key, hash);
+  if (NULL != t->entries[i].key) {
+    return &t->entries[i];
+  }
+  if (NULL != t->old_entries) {
+    i = table_probe(t->old_entries, t->old_capacity, key, hash);
+    if (NULL != t->old_entries[i].key) {
+      return &t->old_entries[i];
+    }
+  }
+  return NULL;
+}
+
+LISP_VALUE *table_get(HASHTABLE *t, LISP_VALUE *key)
+{
+  TABLE_ENTRY *e;
+  table_migrate(t, TABLE_MIGRATE_STEP);
+  e = table_find(t, key, table_hash(key));
+  return NULL == e ? NULL : e->value;
+}
+
+int table_put(HASHTABLE *t, LISP_VALUE *key, LISP_VALUE *value)
+{
+  uint64_t hash = table_hash(key);
+  int64_t i;
+  table_migrate(t, TABLE_MIGRATE_STEP);
+  if ((t->count + 1)*4 > t->capacity*3 && !table_grow(t)) {
+    return 0;
+  }
+  i = table_probe(t->entries, t->capacity, key, hash);
+  if (NULL == t->entries[i].key) {
+    // New entries only go into the new array.
+    if (NULL != t->old_entries) {
+      table_delete(t, key, hash);
+    }
+    t->entries[i].key = key;
+    t->entries[i].hash = hash;
+    t->count += 1;
+  }
+  t->entries[i].value = value;
+  return 1;
+}
+
+// Removes key and returns its value, or NULL if it was not there.
+LISP_VALUE *table_delete(HASHTABLE *t, LISP_VALUE *key, uint64_t hash)
+{
+  LISP_VALUE *value;
+  int64_t i = table_probe(t->entries, t->capacity, key, hash);
+  if (NULL != t->entries[i].key) {
+    value = t->entries[i].value;
+    table_remove_slot(t->entries, t->capacity, i);
+    t->count -= 1;
+    return value;
+  }
+  if (NULL != t->old_entries) {
+    i = table_probe(t->old_entries, t->old_capacity, key, hash);
+    if (NULL != t->old_entries[i].key) {
+      value = t->old_entries[i].value;
+      t->old_entries[i].key = TABLE_TOMBSTONE;
+      t->old_entries[i].value = NULL;
+      t->count -= 1;
+      return value;
+    }
+  }
+  return NULL;
+}
+
+void table_gc_walk(HASHTABLE *t, int depth)
+{
+  int64_t i;
+  for (i = 0; i < t->capacity; ++i) {
+    if (NULL != t->entries[i].key) {
+      gc_walk(t->entries[i].key, depth);
+      gc_walk(t->entries[i].value, depth);
+    }
+  }
+  for (i = t->migrate_pos; i < t->old_capacity; ++i) {
+    if (NULL != t->old_entries[i].key &&
+        TABLE_TOMBSTONE != t->old_entries[i].key) {
+      gc_walk(t->old_entries[i].key, depth);
+      gc_walk(t->old_entries[i].value, depth);
+    }
+  }
+}
+
+void table_free(HASHTABLE *t)
+{
+  free(t->entries);
+  free(t->old_entries);
+  free(t);
+}
+
+//------------------------------------------------------------------------------
+/// Hash table built-ins
+
+LISP_VALUE *fn_make_table(LISP_VALUE *env)
+{
+  HASHTABLE *t = calloc(1, sizeof(HASHTABLE));
+  LISP_VALUE *ret;
+  if (NULL == t ||
+      NULL == (t->entries = calloc(TABLE_INITIAL_CAPACITY,
+                                   sizeof(TABLE_ENTRY)))) {
+    free(t);
+    error("Cannot allocate hash table.");
+    return NULL;
+  }
+  t->capacity = TABLE_INITIAL_CAPACITY;
+  ret = new_value(V_HASHTABLE);
+  ret->hashtable = t;
+  return ret;
+}
+
+// A table owned by another heap (read by a pmap worker) is only looked at:
+// migrating its slots would race with the other workers, and putting or
+// deleting would leave the owner pointing into the worker's heap.
+LISP_VALUE *fn_table_get(LISP_VALUE *table, LISP_VALUE *key, LISP_VALUE *env)
+{
+  LISP_VALUE *value;
+  TABLE_ENTRY *e;
+  if (IN_HEAP(table)) {
+    value = table_get(table->hashtable, key);
+  } else {
+    e = table_find(table->hashtable, key, table_hash(key));
+    value = NULL == e ? NULL : e->value;
+  }
+  return NULL == value ? create_nil() : value;
+}
+
+LISP_VALUE *fn_table_put(LISP_VALUE *table, LISP_VALUE *key, LISP_VALUE *value,
+                         LISP_VALUE *env)
+{
+  if (!IN_HEAP(table)) {
+    error("Cannot modify a table from another heap.");
+    return NULL;
+  }
+  return table_put(table->hashtable, key, value) ? value : NULL;
+}
+
+LISP_VALUE *fn_table_del(LISP_VALUE *table, LISP_VALUE *key, LISP_VALUE *env)
+{
+  LISP_VALUE *value;
+  if (!IN_HEAP(table)) {
+    error("Cannot modify a table from another heap.");
+    return NULL;
+  }
+  table_migrate(table->hashtable, TABLE_MIGRATE_STEP);
+  value = table_delete(table->hashtable, key, table_hash(key));
+  return NULL == value ? create_nil() : value;
+}
+
+LISP_VALUE *fn_table_count(LISP_VALUE *table, LISP_VALUE *env)
+{
+  return create_intnum(table->hashtable->count);
+}
+
+void install_table_builtins(void)
+{
+  int idx;
+  install_builtin_fn("make-table", "make-table", fn_make_table, 0);
+  idx = install_builtin_fn("table-get", "table-get", fn_table_get, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_HASHTABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT | V_SYMBOL);
+  idx = install_builtin_fn("table-put!", "table-put!", fn_table_put, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_HASHTABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT | V_SYMBOL);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_ANY);
+  idx = install_builtin_fn("table-del!", "table-del!", fn_table_del, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_HASHTABLE);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT | V_SYMBOL);
+  idx = install_builtin_fn("table-count", "table-count", fn_table_count, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_HASHTABLE);
+}
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Green threads
+//
+// (spawn f) creates a task that runs (f) and returns its id.  Tasks are
+// cooperative: the running task keeps the interpreter until it calls
+// (yield), blocks in (send ch v) on a full channel or in (recv ch) on an
+// empty one, or finishes.  The next task is then taken from a FIFO run
+// queue.  The interpreter's own thread of control is the main task; any
+// tasks still runnable when a file or the REPL finishes are run to
+// completion by sched_drain().
+//
+// eval() is recursive, so every task gets its own C stack: TASK_STACK_SIZE
+// bytes of address space of which only the pages actually touched are ever
+// committed.  The garbage collector scans the live part of the stack and the
+// saved registers of every suspended task, walks the functions of tasks that
+// have not started yet, and the buffers of reachable channels.
+
+// Top of the calling thread's stack.  Sets *bottom to its lowest address.
+char *thread_stack_top(char **bottom)
+{
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  if (0 != pthread_getattr_np(pthread_self(), &attr)) {
+    fatal("Cannot find the thread's stack.");
+  }
+  pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  *bottom = addr;
+  return (char *) addr + size;
+}
+
+void sched_init(void)
+{
+  TASK *main_task = calloc(1, sizeof(TASK));
+  char *bottom;
+  main_task->state = TASK_RUNNABLE;
+  main_task->stack_top = thread_stack_top(&bottom);
+  main_task->stack_limit = bottom + STACK_MARGIN;
+  interp->main_task = main_task;
+  interp->current_task = main_task;
+  interp->all_tasks = main_task;
+  interp->next_task_id = 1;
+}
+
+// Reports why a task stack could not be set up.
+void task_stack_error(char *call)
+{
+  char msg[128];
+  snprintf(msg, sizeof(msg), "Cannot allocate task stack: %s: %s.", call,
+           strerror(errno));
+  error(msg);
+}
+
+char *task_stack_alloc(void)
+{
+  char *stack;
+  if (interp->n_free_stacks > 0) {
+    return interp->free_stacks[--interp->n_free_stacks];
+  }
+  stack = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (MAP_FAILED == stack) {
+    task_stack_error("mmap");
+    return NULL;
+  }
+  // Guard page: running off the end of the stack faults instead of
+  // scribbling over another task.  It splits the mapping in two, so every
+  // task costs two of the process's vm.max_map_count mappings.
+  if (0 != mprotect(stack, 4096, PROT_NONE)) {
+    task_stack_error("mprotect");
+    munmap(stack, TASK_STACK_SIZE);
+    return NULL;
+  }
+  return stack;
+}
+
+void task_stack_free(INTERP *in, char *stack)
+{
+  if (in->n_free_stacks < TASK_STACK_POOL) {
+    in->free_stacks[in->n_free_stacks++] = stack;
+  } else {
+    munmap(stack, TASK_STACK_SIZE);
+  }
+}
+
+void run_queue_push(TASK *t)
+{
+  t->next = NULL;
+  t->state = TASK_RUNNABLE;
+  if (NULL == interp->run_tail) {
+    interp->run_head = t;
+  } else {
+    interp->run_tail->next = t;
+  }
+  interp->run_tail = t;
+}
+
+TASK *run_queue_pop(void)
+{
+  TASK *t = interp->run_head;
+  if (NULL != t) {
+    interp->run_head = t->next;
+    if (NULL == interp->run_head) {
+      interp->run_tail = NULL;
+    }
+    t->next = NULL;
+  }
+  return t;
+}
+
+// Frees the stacks of finished tasks.  Must not run on the stack of a task
+// being freed, so it is called right after every context switch.
+void task_reap(void)
+{
+  TASK **p = &interp->all_tasks;
+  TASK *t;
+  while (NULL != (t = *p)) {
+    if (TASK_DONE == t->state && t != interp->current_task) {
+      *p = t->next_task;
+      task_stack_free(interp, t->stack);
+      free(t);
+    } else {
+      p = &t->next_task;
+    }
+  }
+}
+
+void sched_switch(TASK *to)
+{
+  TASK *from = interp->current_task;
+  if (to == from) {
+    return;
+  }
+  from->stack_lo = stack_pointer();
+  interp->current_task = to;
+  swapcontext(&from->context, &to->context);
+  task_reap();
+}
+
+// Removes t from the queue it is blocked on.
+void wait_queue_remove(TASK *t)
+{
+  TASK **p;
+  if (NULL == t->waiting_on) {
+    return;
+  }
+  for (p = t->waiting_on; NULL != *p; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+  }
+  t->waiting_on = NULL;
+  t->next = NULL;
+}
+
+// Picks the task to run when the current one stops.  If nothing is
+// runnable every task is blocked, so the main task is woken up to report
+// the deadlock.
+TASK *sched_next(void)
+{
+  TASK *t = run_queue_pop();
+  TASK *main_task = interp->main_task;
+  if (NULL == t && main_task != interp->current_task &&
+      TASK_BLOCKED == main_task->state) {
+    wait_queue_remove(main_task);
+    main_task->deadlocked = 1;
+    main_task->state = TASK_RUNNABLE;
+    t = main_task;
+  }
+  return t;
+}
+
+void task_entry(void)
+{
+  TASK *self = interp->current_task;
+  LISP_VALUE *args;
+  task_reap();
+  args = create_nil();
+  apply_fn(self->fn, args);
+  self->state = TASK_DONE;
+  self->fn = NULL;
+  sched_switch(sched_next());
+  // A finished task is never switched back to.
+  fatal("Finished task resumed.");
+}
+
+// Returns NULL, after reporting why, if the task cannot be created.
+TASK *task_create(LISP_VALUE *fn)
+{
+  TASK *t = calloc(1, sizeof(TASK));
+  if (NULL == t) {
+    error("Cannot allocate task.");
+    return NULL;
+  }
+  if (NULL == (t->stack = task_stack_alloc())) {
+    free(t);
+    return NULL;
+  }
+  t->id = interp->next_task_id++;
+  t->fn = fn;
+  t->stack_top = t->stack + TASK_STACK_SIZE;
+  t->stack_limit = t->stack + 4096 + STACK_MARGIN;
+  getcontext(&t->context);
+  t->context.uc_stack.ss_sp = t->stack;
+  t->context.uc_stack.ss_size = TASK_STACK_SIZE;
+  t->context.uc_link = NULL;
+  makecontext(&t->context, task_entry, 0);
+  t->next_task = interp->all_tasks;
+  interp->all_tasks = t;
+  run_queue_push(t);
+  return t;
+}
+
+// Suspends the current task on queue until it is woken up.  Returns 0 if it
+// was woken because every task is blocked.
+int sched_block(TASK **queue)
+{
+  TASK *self = interp->current_task;
+  TASK *next;
+  TASK **p;
+  for (p = queue; NULL != *p; p = &(*p)->next) {
+  }
+  *p = self;
+  self->next = NULL;
+  self->state = TASK_BLOCKED;
+  self->waiting_on = queue;
+  self->deadlocked = 0;
+  if (NULL == (next = sched_next())) {
+    // Only the main task gets here: nothing else can run.
+    wait_queue_remove(self);
+    self->state = TASK_RUNNABLE;
+    return 0;
+  }
+  sched_switch(next);
+  return !self->deadlocked;
+}
+
+// Makes the first task blocked on queue runnable.
+void sched_wake(TASK **queue)
+{
+  TASK *t = *queue;
+  if (NULL != t) {
+    *queue = t->next;
+    t->waiting_on = NULL;
+    run_queue_push(t);
+  }
+}
+
+void task_yield(void)
+{
+  TASK *next = run_queue_pop();
+  if (NULL != next) {
+    run_queue_push(interp->current_task);
+    sched_switch(next);
+  }
+}
+
+// Runs every runnable task to completion or until it blocks.
+void sched_drain(void)
+{
+  TASK *t;
+  int n_blocked = 0;
+  while (NULL != interp->run_head) {
+    task_yield();
+  }
+  for (t = interp->all_tasks; NULL != t; t = t->next_task) {
+    n_blocked += TASK_BLOCKED == t->state;
+  }
+  if (n_blocked > 0) {
+    flush_output();
+    fprintf(stderr, "WARNING: %d task(s) left blocked on channels.\n",
+            n_blocked);
+  }
+}
+
+// The running task's stack is scanned by sweep().  swapcontext() saved the
+// registers of the others in their context.
+void sched_gc_walk(void)
+{
+  TASK *t;
+  for (t = interp->all_tasks; NULL != t; t = t->next_task) {
+    gc_walk(t->fn, 0);
+    if (t != interp->current_task && TASK_DONE != t->state &&
+        NULL != t->stack_lo) {
+      gc_scan_range(&t->context, &t->context + 1);
+      gc_scan_range(t->stack_lo, t->stack_top);
+    }
+  }
+}
+
+void sched_destroy(INTERP *in)
+{
+  TASK *t;
+  TASK *next;
+  int i;
+  for (t = in->all_tasks; NULL != t; t = next) {
+    next = t->next_task;
+    if (NULL != t->stack) {
+      munmap(t->stack, TASK_STACK_SIZE);
+    }
+    free(t);
+  }
+  for (i = 0; i < in->n_free_stacks; ++i) {
+    munmap(in->free_stacks[i], TASK_STACK_SIZE);
+  }
+  in->all_tasks = NULL;
+  in->n_free_stacks = 0;
+}
+
+void channel_gc_walk(CHANNEL *ch, int depth)
+{
+  int i;
+  for (i = 0; i < ch->count; ++i) {
+    gc_walk(ch->buffer[(ch->head + i) % ch->capacity], depth);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Task built-ins
+
+LISP_VALUE *fn_spawn(LISP_VALUE *fn, LISP_VALUE *env)
+{
+  TASK *t = task_create(fn);
+  if (NULL == t) {
+    return NULL;
+  }
+  return create_intnum(t->id);
+}
+
+LISP_VALUE *fn_yield(LISP_VALUE *env)
+{
+  task_yield();
+  return create_nil();
+}
+
+LISP_VALUE *fn_make_channel(LISP_VALUE *capacity, LISP_VALUE *env)
+{
+  LISP_VALUE *ret;
+  CHANNEL *ch;
+  if (capacity->intnum < 1) {
+    error("Channel capacity must be at least 1.");
+    return NULL;
+  }
+  ch = calloc(1, sizeof(CHANNEL) + capacity->intnum*sizeof(LISP_VALUE *));
+  if (NULL == ch) {
+    error("Cannot allocate channel.");
+    return NULL;
+  }
+  ch->capacity = capacity->intnum;
+  ret = new_value(V_CHANNEL);
+  ret->channel = ch;
+  return ret;
+}
+
+// A channel belongs to the scheduler of the interpreter that made it.  A
+// pmap worker may not use the caller's channels: it would leave its own
+// cells in the buffer and queue its tasks on another interpreter's channel.
+LISP_VALUE *fn_send(LISP_VALUE *chan, LISP_VALUE *v, LISP_VALUE *env)
+{
+  CHANNEL *ch = chan->channel;
+  if (!IN_HEAP(chan)) {
+    error("Cannot use a channel from another heap.");
+    return NULL;
+  }
+  while (ch->count == ch->capacity) {
+    if (!sched_block(&ch->senders)) {
+      error("Deadlock: send on a full channel with no other task runnable.");
+      return NULL;
+    }
+  }
+  ch->buffer[(ch->head + ch->count) % ch->capacity] = v;
+  ch->count += 1;
+  sched_wake(&ch->receivers);
+  return v;
+}
+
+LISP_VALUE *fn_recv(LISP_VALUE *chan, LISP_VALUE *env)
+{
+  CHANNEL *ch = chan->channel;
+  LISP_VALUE *v;
+  if (!IN_HEAP(chan)) {
+    error("Cannot use a channel from another heap.");
+    return NULL;
+  }
+  while (0 == ch->count) {
+    if (!sched_block(&ch->receivers)) {
+      error("Deadlock: recv on an empty channel with no other task runnable.");
+      return NULL;
+    }
+  }
+  v = ch->buffer[ch->head];
+  ch->head = (ch->head + 1) % ch->capacity;
+  ch->count -= 1;
+  sched_wake(&ch->senders);
+  return v;
+}
+
+void install_task_builtins(void)
+{
+  int idx;
+  idx = install_builtin_fn("spawn", "spawn", fn_spawn, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CALLABLE);
+  install_builtin_fn("yield", "yield", fn_yield, 0);
+  idx = install_builtin_fn("make-channel", "make-channel", fn_make_channel, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("send", "send", fn_send, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CHANNEL);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_ANY);
+  idx = install_builtin_fn("recv", "recv", fn_recv, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CHANNEL);
+}
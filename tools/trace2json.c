@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "../util.h"
+#include "../micro-lisp.h"
+
+//------------------------------------------------------------------------------
+/// Trace decoder
+//
+// Turns a dump written by ml -DTRACE ($ML_TRACE) into Chrome trace JSON:
+//
+//   tools/trace2json ml.trace > trace.json
+//
+// and load trace.json in chrome://tracing or ui.perfetto.dev.  Evaluations,
+// builtin calls and collections become nested slices on the thread that ran
+// them, allocations instant events.  Exits that lost their enter when the
+// ring wrapped are dropped.
+
+// Prints name as a JSON string, "dflt" if it is empty.
+void print_name(char *name, char *dflt)
+{
+  int i;
+  if ('\0' == name[0]) {
+    printf("\"%s\"", dflt);
+    return;
+  }
+  putchar('"');
+  for (i = 0; i < SYM_SIZE && '\0' != name[i]; ++i) {
+    if ('"' == name[i] || '\\' == name[i]) {
+      printf("\\%c", name[i]);
+    } else if ((unsigned char) name[i] < ' ') {
+      printf("\\u%04x", name[i]);
+    } else {
+      putchar(name[i]);
+    }
+  }
+  putchar('"');
+}
+
+// Writes the events of one ring.  Returns 0 if the file ends early.
+int decode_ring(FILE *in, TRACE_RING_HEADER *h, uint64_t base_ns, int *first)
+{
+  TRACE_RECORD r;
+  double ns_per_tick = h->end_tsc == h->start_tsc ? 0
+    : (double) (h->end_ns - h->start_ns)/(h->end_tsc - h->start_tsc);
+  double us;
+  uint64_t i;
+  int depth = 0;
+  char *cat;
+  for (i = 0; i < h->n_records; ++i) {
+    if (1 != fread(&r, sizeof(r), 1, in)) {
+      return 0;
+    }
+    us = (h->start_ns - base_ns + (double) (r.tsc - h->start_tsc)*ns_per_tick)
+      /1000;
+    switch (r.type) {
+      case TRACE_EVAL_ENTER:
+      case TRACE_EVAL_EXIT:
+        cat = "eval";
+        break;
+      case TRACE_BUILTIN_ENTER:
+      case TRACE_BUILTIN_EXIT:
+        cat = "builtin";
+        break;
+      case TRACE_GC_START:
+      case TRACE_GC_END:
+        cat = "gc";
+        break;
+      default:
+        cat = "alloc";
+        break;
+    }
+    switch (r.type) {
+      case TRACE_EVAL_EXIT:
+      case TRACE_BUILTIN_EXIT:
+      case TRACE_GC_END:
+        if (0 == depth) {
+          continue;
+        }
+        depth -= 1;
+        break;
+      case TRACE_EVAL_ENTER:
+      case TRACE_BUILTIN_ENTER:
+      case TRACE_GC_START:
+        depth += 1;
+        break;
+    }
+    printf("%s\n{\"cat\":\"%s\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,",
+           *first ? "" : ",", cat, (unsigned long long) h->tid, us);
+    *first = 0;
+    switch (r.type) {
+      case TRACE_EVAL_ENTER:
+      case TRACE_BUILTIN_ENTER:
+        printf("\"ph\":\"B\",\"name\":");
+        print_name(r.name, "(fn)");
+        break;
+      case TRACE_EVAL_EXIT:
+      case TRACE_BUILTIN_EXIT:
+        printf("\"ph\":\"E\",\"name\":");
+        print_name(r.name, "(fn)");
+        break;
+      case TRACE_GC_START:
+        printf("\"ph\":\"B\",\"name\":\"gc\",\"args\":{\"allocated\":%u}",
+               r.aux);
+        break;
+      case TRACE_GC_END:
+        printf("\"ph\":\"E\",\"name\":\"gc\",\"args\":{\"freed\":%u}", r.aux);
+        break;
+      default:
+        printf("\"ph\":\"i\",\"s\":\"t\",\"name\":");
+        print_name(r.name, "alloc");
+        break;
+    }
+    putchar('}');
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  TRACE_RING_HEADER h;
+  FILE *in;
+  char magic[8];
+  uint64_t base_ns = UINT64_MAX;
+  long start;
+  int first = 1;
+  if (2 != argc) {
+    fprintf(stderr, "usage: %s TRACE-FILE > trace.json\n", argv[0]);
+    return 1;
+  }
+  if (NULL == (in = fopen(argv[1], "rb"))) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (1 != fread(magic, 8, 1, in) || 0 != memcmp(magic, TRACE_MAGIC, 8)) {
+    fprintf(stderr, "%s: not a micro-lisp trace\n", argv[1]);
+    return 1;
+  }
+  // Times are relative to the ring claimed first.
+  start = ftell(in);
+  while (1 == fread(&h, sizeof(h), 1, in)) {
+    if (h.start_ns < base_ns) {
+      base_ns = h.start_ns;
+    }
+    fseek(in, h.n_records*sizeof(TRACE_RECORD), SEEK_CUR);
+  }
+  fseek(in, start, SEEK_SET);
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  while (1 == fread(&h, sizeof(h), 1, in)) {
+    if (!decode_ring(in, &h, base_ns, &first)) {
+      fprintf(stderr, "%s: truncated\n", argv[1]);
+      break;
+    }
+  }
+  printf("\n]}\n");
+  fclose(in);
+  return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Event trace
+//
+// Built with -DTRACE (make ml-trace), TRACE_EVENT() writes a fixed size
+// record stamped with read_ticks() (the TSC on x86-64) into the ring of
+// the calling thread: entering and leaving eval_application() and
+// eval_syntax(), builtin calls, every cell cell_take() hands out and the
+// start and end of each collection.
+// Without -DTRACE the hooks compile to nothing.
+//
+// Rings are only kept with $ML_TRACE set to a file name.  Each interpreter
+// claims one (the main one and each pmap or batch worker) and keeps the
+// last TRACE_RECORDS events; rings of finished threads stay in the dump
+// until another thread reuses them.  All rings are written to $ML_TRACE at
+// exit, on SIGUSR1 and by (trace-dump).  tools/trace2json turns the dump
+// into Chrome trace JSON for chrome://tracing or Perfetto.
+
+char *trace_path = NULL;
+
+TRACE_RING *trace_rings[TRACE_MAX_RINGS];
+pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Claims a ring for the calling thread's interpreter.  Without a free one
+// the thread is not traced.
+void trace_thread_start(void)
+{
+  TRACE_RING *t = NULL;
+  int i;
+  if (NULL == trace_path) {
+    return;
+  }
+  pthread_mutex_lock(&trace_rings_lock);
+  for (i = 0; i < TRACE_MAX_RINGS; ++i) {
+    if (NULL == trace_rings[i]) {
+      trace_rings[i] = calloc(1, sizeof(TRACE_RING));
+    }
+    if (NULL != (t = trace_rings[i]) && !t->in_use) {
+      t->in_use = 1;
+      break;
+    }
+    t = NULL;
+  }
+  pthread_mutex_unlock(&trace_rings_lock);
+  if (NULL == t) {
+    return;
+  }
+  t->tid = syscall(SYS_gettid);
+  t->n_written = 0;
+  t->start_ns = now_ns();
+  t->start_tsc = read_ticks();
+  interp->trace = t;
+}
+
+// Gives the ring back.  Its records are dumped until it is claimed again.
+void trace_thread_stop(INTERP *in)
+{
+  if (NULL != in->trace) {
+    pthread_mutex_lock(&trace_rings_lock);
+    in->trace->in_use = 0;
+    pthread_mutex_unlock(&trace_rings_lock);
+    in->trace = NULL;
+  }
+}
+
+// Names recorded for forms and builtins.
+char *form_name(LISP_VALUE *expr)
+{
+  return IS_TYPE(car(expr), V_SYMBOL) ? car(expr)->symbol : NULL;
+}
+
+char *builtin_name(BUILTIN_INFO *pinfo)
+{
+  return '\0' != pinfo->var_name[0] ? pinfo->var_name : pinfo->name;
+}
+
+void trace_event(int type, uint32_t aux, char *name)
+{
+  TRACE_RING *t = interp->trace;
+  TRACE_RECORD *r;
+  if (NULL == t) {
+    return;
+  }
+  r = &t->records[t->n_written++ & (TRACE_RECORDS - 1)];
+  r->tsc = read_ticks();
+  r->type = type;
+  r->aux = aux;
+  if (NULL == name) {
+    r->name[0] = '\0';
+  } else {
+    strncpy(r->name, name, SYM_SIZE);
+  }
+}
+
+// Writes every ring with records to path.  Only uses calls that are safe in
+// a signal handler; rings of running threads are copied as they change.
+int trace_dump(char *path)
+{
+  TRACE_RING_HEADER h;
+  TRACE_RING *t;
+  struct timespec ts;
+  uint64_t written;
+  uint64_t first;
+  uint64_t tail;
+  int ok;
+  int fd;
+  int i;
+  if (-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+    return 0;
+  }
+  ok = 0 == write_all(fd, TRACE_MAGIC, 8);
+  for (i = 0; ok && i < TRACE_MAX_RINGS; ++i) {
+    if (NULL == (t = trace_rings[i]) || 0 == (written = t->n_written)) {
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h.end_tsc = read_ticks();
+    h.end_ns = (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+    h.tid = t->tid;
+    h.start_tsc = t->start_tsc;
+    h.start_ns = t->start_ns;
+    h.n_records = written < TRACE_RECORDS ? written : TRACE_RECORDS;
+    // Oldest first: records[first..] and, if the ring wrapped, the records
+    // before first.
+    first = (written - h.n_records) & (TRACE_RECORDS - 1);
+    tail = TRACE_RECORDS - first < h.n_records ? TRACE_RECORDS - first
+                                               : h.n_records;
+    ok = 0 == write_all(fd, (char *) &h, sizeof(h)) &&
+      0 == write_all(fd, (char *) &t->records[first],
+                     tail*sizeof(TRACE_RECORD)) &&
+      0 == write_all(fd, (char *) t->records,
+                     (h.n_records - tail)*sizeof(TRACE_RECORD));
+  }
+  close(fd);
+  return ok;
+}
+
+void trace_on_signal(int sig)
+{
+  trace_dump(trace_path);
+}
+
+// atexit() handler.
+void trace_at_exit(void)
+{
+  if (!trace_dump(trace_path)) {
+    perror(trace_path);
+  }
+}
+
+//------------------------------------------------------------------------------
+/// Event trace built-ins
+
+// (trace-dump): writes the rings to $ML_TRACE now.  t if it did.
+LISP_VALUE *fn_trace_dump(LISP_VALUE *env)
+{
+  if (NULL == trace_path) {
+    error("trace-dump needs $ML_TRACE set.");
+    return NULL;
+  }
+  return lisp_bool(trace_dump(trace_path));
+}
+
+void install_trace_builtins(void)
+{
+  char *path = getenv("ML_TRACE");
+  if (NULL != path && '\0' != path[0]) {
+#ifdef TRACE
+    trace_path = path;
+    atexit(trace_at_exit);
+    signal(SIGUSR1, trace_on_signal);
+#else
+    fprintf(stderr, "ML_TRACE is ignored: this ml was built without "
+            "-DTRACE (make ml-trace).\n");
+#endif
+  }
+  install_builtin_fn("trace-dump", "trace-dump", fn_trace_dump, 0);
+}
@@ -37,3 +37,9 @@
 
 #define DBG_PRINT_LISP_VAR(var)
 #endif
+
+#ifdef TRACE
+#define TRACE_EVENT(type, aux, name) trace_event(type, aux, name)
+#else
+#define TRACE_EVENT(type, aux, name)
+#endif
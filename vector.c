@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include "util.h"
+#include "micro-lisp.h"
+#include "proto.h"
+
+//------------------------------------------------------------------------------
+/// Vectors
+//
+// A vector is a cell pointing at a malloc()ed VECTOR of unboxed 64-bit
+// integers, so a million numbers cost one cell and 8MB instead of two
+// million cells.  The element-wise builtins run over the data with the
+// kernels below: AVX2 versions are picked once at start up when the CPU has
+// AVX2, and the scalar versions (which the compiler is free to vectorize
+// with SSE2) are used otherwise.
+//
+// (mmap-ints file 'i32) and (mmap-ints file 'i64) map a file of native
+// 32- or 64-bit integers read-only and return a vector viewing it, so a
+// dump of any size is usable without being parsed or copied.  The kernels
+// work on 64-bit elements; a 32-bit vector is summed by a loop of its own
+// and widened into a temporary copy for the other operations.
+
+vector_binop_fn vector_add_kernel = vector_add_scalar;
+vector_binop_fn vector_mul_kernel = vector_mul_scalar;
+vector_fold_fn vector_dot_kernel = vector_dot_scalar;
+vector_fold_fn vector_sum_kernel = vector_sum_scalar;
+
+void vector_add_scalar(int64_t *dst, int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = a[i] + b[i];
+  }
+}
+
+void vector_mul_scalar(int64_t *dst, int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = a[i]*b[i];
+  }
+}
+
+int64_t vector_dot_scalar(int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t sum = 0;
+  int64_t i;
+  for (i = 0; i < n; ++i) {
+    sum += a[i]*b[i];
+  }
+  return sum;
+}
+
+// b is unused.
+int64_t vector_sum_scalar(int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t sum = 0;
+  int64_t i;
+  for (i = 0; i < n; ++i) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+int64_t vector_sum32(int32_t *a, int64_t n)
+{
+  int64_t sum = 0;
+  int64_t i;
+  for (i = 0; i < n; ++i) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+#ifdef __x86_64__
+// Low 64 bits of a*b for each lane.  AVX2 has no 64-bit multiply, so the
+// product is built from 32x32->64 bit multiplies.
+#define MUL_EPI64_AVX2(a, b)                                            \
+  _mm256_add_epi64(_mm256_mul_epu32((a), (b)),                          \
+                   _mm256_slli_epi64(                                   \
+                     _mm256_add_epi64(                                  \
+                       _mm256_mul_epu32(_mm256_srli_epi64((a), 32), (b)), \
+                       _mm256_mul_epu32((a), _mm256_srli_epi64((b), 32))), \
+                     32))
+
+__attribute__((target("avx2")))
+void vector_add_avx2(int64_t *dst, int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t i;
+  __m256i x;
+  __m256i y;
+  for (i = 0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((__m256i *) (a + i));
+    y = _mm256_loadu_si256((__m256i *) (b + i));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_add_epi64(x, y));
+  }
+  vector_add_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void vector_mul_avx2(int64_t *dst, int64_t *a, int64_t *b, int64_t n)
+{
+  int64_t i;
+  __m256i x;
+  __m256i y;
+  for (i = 0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((__m256i *) (a + i));
+    y = _mm256_loadu_si256((__m256i *) (b + i));
+    _mm256_storeu_si256((__m256i *) (dst + i), MUL_EPI64_AVX2(x, y));
+  }
+  vector_mul_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t vector_dot_avx2(int64_t *a, int64_t *b, int64_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  __m256i x;
+  __m256i y;
+  int64_t lanes[4];
+  int64_t i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((__m256i *) (a + i));
+    y = _mm256_loadu_si256((__m256i *) (b + i));
+    acc = _mm256_add_epi64(acc, MUL_EPI64_AVX2(x, y));
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    vector_dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t vector_sum_avx2(int64_t *a, int64_t *b, int64_t n)
+{
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  int64_t lanes[4];
+  int64_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256((__m256i *) (a + i)));
+    acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256((__m256i *) (a + i + 4)));
+  }
+  _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    vector_sum_scalar(a + i, NULL, n - i);
+}
+#endif
+
+void vector_kernels_init(void)
+{
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && NULL == getenv("ML_NO_SIMD")) {
+    vector_add_kernel = vector_add_avx2;
+    vector_mul_kernel = vector_mul_avx2;
+    vector_dot_kernel = vector_dot_avx2;
+    vector_sum_kernel = vector_sum_avx2;
+  }
+#endif
+}
+
+// Returns a new vector cell of n elements, not initialized.
+LISP_VALUE *create_vector(int64_t n)
+{
+  VECTOR *vec;
+  LISP_VALUE *ret;
+  if (n < 0 || n > (int64_t) ((SIZE_MAX - sizeof(VECTOR))/sizeof(int64_t)) ||
+      NULL == (vec = malloc(sizeof(VECTOR) + n*sizeof(int64_t)))) {
+    error("Cannot allocate vector.");
+    return NULL;
+  }
+  vec->length = n;
+  vec->elem_size = sizeof(int64_t);
+  vec->map_size = 0;
+  vec->data = vec->storage;
+  ret = new_value(V_VECTOR);
+  ret->vector = vec;
+  return ret;
+}
+
+void vector_free(VECTOR *vec)
+{
+  if (0 != vec->map_size) {
+    munmap(vec->data, vec->map_size);
+  }
+  free(vec);
+}
+
+int64_t vector_elem(VECTOR *vec, int64_t i)
+{
+  return sizeof(int64_t) == vec->elem_size ? vec->data[i] : vec->data32[i];
+}
+
+// The elements of vec as 64-bit integers: vec's own data, or a malloc()ed
+// copy the caller frees with vector_widened_free().
+int64_t *vector_widen(VECTOR *vec)
+{
+  int64_t *wide;
+  int64_t i;
+  if (sizeof(int64_t) == vec->elem_size) {
+    return vec->data;
+  }
+  if (NULL == (wide = malloc(vec->length > 0 ? vec->length*sizeof(int64_t) : 1))) {
+    error("Cannot allocate vector.");
+    return NULL;
+  }
+  for (i = 0; i < vec->length; ++i) {
+    wide[i] = vec->data32[i];
+  }
+  return wide;
+}
+
+void vector_widened_free(VECTOR *vec, int64_t *wide)
+{
+  if (wide != vec->data) {
+    free(wide);
+  }
+}
+
+void print_vector(VECTOR *vec)
+{
+  int64_t i;
+  fprintf(interp->output, "#(");
+  for (i = 0; i < vec->length; ++i) {
+    fprintf(interp->output, i > 0 ? " %lld" : "%lld",
+            (long long) vector_elem(vec, i));
+  }
+  fprintf(interp->output, ")");
+}
+
+int vector_check_index(VECTOR *vec, LISP_VALUE *index)
+{
+  if (index->intnum < 0 || index->intnum >= vec->length) {
+    error("Vector index out of range.");
+    return 0;
+  }
+  return 1;
+}
+
+int vector_check_lengths(VECTOR *a, VECTOR *b)
+{
+  if (a->length != b->length) {
+    error("Vectors differ in length.");
+    return 0;
+  }
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Vector built-ins
+
+LISP_VALUE *fn_make_vector(LISP_VALUE *n, LISP_VALUE *fill, LISP_VALUE *env)
+{
+  LISP_VALUE *ret = create_vector(n->intnum);
+  int64_t i;
+  if (NULL != ret) {
+    for (i = 0; i < n->intnum; ++i) {
+      ret->vector->data[i] = fill->intnum;
+    }
+  }
+  return ret;
+}
+
+LISP_VALUE *fn_vector_length(LISP_VALUE *v, LISP_VALUE *env)
+{
+  return create_intnum(v->vector->length);
+}
+
+LISP_VALUE *fn_vector_ref(LISP_VALUE *v, LISP_VALUE *index, LISP_VALUE *env)
+{
+  if (!vector_check_index(v->vector, index)) {
+    return NULL;
+  }
+  return create_intnum(vector_elem(v->vector, index->intnum));
+}
+
+LISP_VALUE *fn_vector_set(LISP_VALUE *v, LISP_VALUE *index, LISP_VALUE *x,
+                          LISP_VALUE *env)
+{
+  if (!vector_check_index(v->vector, index)) {
+    return NULL;
+  }
+  if (0 != v->vector->map_size) {
+    error("vector-set!: vector is a read-only file mapping.");
+    return NULL;
+  }
+  v->vector->data[index->intnum] = x->intnum;
+  return x;
+}
+
+LISP_VALUE *vector_binop(vector_binop_fn kernel, LISP_VALUE *a, LISP_VALUE *b)
+{
+  LISP_VALUE *ret;
+  int64_t *x;
+  int64_t *y;
+  if (!vector_check_lengths(a->vector, b->vector) ||
+      NULL == (ret = create_vector(a->vector->length))) {
+    return NULL;
+  }
+  if (NULL == (x = vector_widen(a->vector))) {
+    return NULL;
+  }
+  if (NULL == (y = vector_widen(b->vector))) {
+    vector_widened_free(a->vector, x);
+    return NULL;
+  }
+  kernel(ret->vector->data, x, y, a->vector->length);
+  vector_widened_free(a->vector, x);
+  vector_widened_free(b->vector, y);
+  return ret;
+}
+
+LISP_VALUE *fn_vector_add(LISP_VALUE *a, LISP_VALUE *b, LISP_VALUE *env)
+{
+  return vector_binop(vector_add_kernel, a, b);
+}
+
+LISP_VALUE *fn_vector_mul(LISP_VALUE *a, LISP_VALUE *b, LISP_VALUE *env)
+{
+  return vector_binop(vector_mul_kernel, a, b);
+}
+
+LISP_VALUE *fn_vector_sum(LISP_VALUE *v, LISP_VALUE *env)
+{
+  if (sizeof(int64_t) != v->vector->elem_size) {
+    return create_intnum(vector_sum32(v->vector->data32, v->vector->length));
+  }
+  return create_intnum(vector_sum_kernel(v->vector->data, NULL,
+                                         v->vector->length));
+}
+
+LISP_VALUE *fn_vector_dot(LISP_VALUE *a, LISP_VALUE *b, LISP_VALUE *env)
+{
+  int64_t *x;
+  int64_t *y;
+  int64_t dot;
+  if (!vector_check_lengths(a->vector, b->vector) ||
+      NULL == (x = vector_widen(a->vector))) {
+    return NULL;
+  }
+  if (NULL == (y = vector_widen(b->vector))) {
+    vector_widened_free(a->vector, x);
+    return NULL;
+  }
+  dot = vector_dot_kernel(x, y, a->vector->length);
+  vector_widened_free(a->vector, x);
+  vector_widened_free(b->vector, y);
+  return create_intnum(dot);
+}
+
+LISP_VALUE *fn_list_to_vector(LISP_VALUE *list, LISP_VALUE *env)
+{
+  LISP_VALUE *ret;
+  LISP_VALUE *p;
+  int64_t n = 0;
+  FOR_LIST(p, list) {
+    if (!IS_TYPE(car(p), V_INT)) {
+      error("list->vector: elements must be integers.");
+      return NULL;
+    }
+    n += 1;
+  }
+  if (NULL == (ret = create_vector(n))) {
+    return NULL;
+  }
+  n = 0;
+  FOR_LIST(p, list) {
+    ret->vector->data[n++] = car(p)->intnum;
+  }
+  return ret;
+}
+
+// (mmap-ints file type): type is the symbol i32 or i64.
+LISP_VALUE *fn_mmap_ints(LISP_VALUE *file, LISP_VALUE *type, LISP_VALUE *env)
+{
+  char path[4096];
+  struct stat st;
+  VECTOR *vec;
+  LISP_VALUE *ret;
+  void *map = NULL;
+  int elem_size;
+  int fd;
+  if (KW_EQ(type, "i32")) {
+    elem_size = sizeof(int32_t);
+  } else if (KW_EQ(type, "i64")) {
+    elem_size = sizeof(int64_t);
+  } else {
+    error("mmap-ints: type must be i32 or i64.");
+    return NULL;
+  }
+  if (!string_to_cstr(file, path, sizeof(path))) {
+    error("mmap-ints: file name too long.");
+    return NULL;
+  }
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    flush_output();
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (0 != st.st_size % elem_size) {
+    close(fd);
+    error("mmap-ints: file size is not a multiple of the element size.");
+    return NULL;
+  }
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // The mapping keeps the file's pages; the descriptor is not needed.
+  close(fd);
+  if (MAP_FAILED == map) {
+    flush_output();
+    perror(path);
+    return NULL;
+  }
+  if (NULL == (vec = malloc(sizeof(VECTOR)))) {
+    if (NULL != map) {
+      munmap(map, st.st_size);
+    }
+    error("Cannot allocate vector.");
+    return NULL;
+  }
+  vec->length = st.st_size/elem_size;
+  vec->elem_size = elem_size;
+  vec->map_size = st.st_size;
+  vec->data = NULL == map ? vec->storage : map;
+  ret = new_value(V_VECTOR);
+  ret->vector = vec;
+  return ret;
+}
+
+void install_vector_builtins(void)
+{
+  int idx;
+  vector_kernels_init();
+  idx = install_builtin_fn("make-vector", "make-vector", fn_make_vector, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("vector-length", "vector-length", fn_vector_length, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  idx = install_builtin_fn("vector-ref", "vector-ref", fn_vector_ref, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("vector-set!", "vector-set!", fn_vector_set, 3);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_INT);
+  set_builtin_arg_info(idx, 2, ARG_EVALED, V_INT);
+  idx = install_builtin_fn("vector+", "vector+", fn_vector_add, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_VECTOR);
+  idx = install_builtin_fn("vector*", "vector*", fn_vector_mul, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_VECTOR);
+  idx = install_builtin_fn("vector-sum", "vector-sum", fn_vector_sum, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  idx = install_builtin_fn("vector-dot", "vector-dot", fn_vector_dot, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_VECTOR);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_VECTOR);
+  idx = install_builtin_fn("list->vector", "list->vector", fn_list_to_vector, 1);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_CONS_CELL | V_NIL);
+  idx = install_builtin_fn("mmap-ints", "mmap-ints", fn_mmap_ints, 2);
+  set_builtin_arg_info(idx, 0, ARG_EVALED, V_STRING);
+  set_builtin_arg_info(idx, 1, ARG_EVALED, V_SYMBOL);
+}